@@ -0,0 +1,388 @@
+/*******************************************************************************************
+ * Copyright 2020 sisyphus                                                                 *
+ *                                                                                         *
+ * chacha20.h - the ChaCha20 stream cipher of RFC 8439, used by the HYBRID mode of         *
+ * encrypt.exe and decrypt.exe. There the MicaliSchnorr generator supplies only the 256   *
+ * bit key and 96 bit nonce, and ChaCha20 supplies the (much cheaper) bulk keystream.      *
+ *                                                                                         *
+ * On x86 the AVX2 (8 blocks at a time) or AVX-512 (16 blocks at a time) kernel is used if *
+ * the CPU supports it - otherwise the portable one block at a time code is used. (A      *
+ * profile written by otptune.exe may choose differently - see otptune.h.)                 *
+ * chacha20_selftest() checks every kernel that this CPU can run against the RFC 8439      *
+ * known answers.                                                                          *
+ *******************************************************************************************/
+
+#ifndef CHACHA20_H
+#define CHACHA20_H
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CHACHA20_X86 1
+#include <immintrin.h>
+#endif
+
+#define CHACHA20_ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define CHACHA20_QR(a, b, c, d)                          \
+ a += b; d ^= a; d = CHACHA20_ROTL(d, 16);               \
+ c += d; b ^= c; b = CHACHA20_ROTL(b, 12);               \
+ a += b; d ^= a; d = CHACHA20_ROTL(d, 8);                \
+ c += d; b ^= c; b = CHACHA20_ROTL(b, 7);
+
+/* XORs nblocks * 64 bytes at buf with keystream, advancing the counter in st[12]. */
+typedef void (*chacha20_fn)(uint32_t st[16], unsigned char *buf, size_t nblocks);
+
+static inline uint32_t chacha20_le32(const unsigned char *p) {
+ return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline void chacha20_init(uint32_t st[16], const unsigned char key[32],
+                                 const unsigned char nonce[12], uint32_t counter) {
+ int i;
+
+ st[0] = 0x61707865;
+ st[1] = 0x3320646e;
+ st[2] = 0x79622d32;
+ st[3] = 0x6b206574;
+ for(i = 0; i < 8; i++)
+   st[4 + i] = chacha20_le32(key + 4 * i);
+ st[12] = counter;
+ for(i = 0; i < 3; i++)
+   st[13 + i] = chacha20_le32(nonce + 4 * i);
+}
+
+/* Write the keystream block for st (without advancing its counter) to out. */
+static inline void chacha20_block(const uint32_t st[16], unsigned char out[64]) {
+ uint32_t x[16];
+ int i;
+
+ memcpy(x, st, sizeof(x));
+
+ for(i = 0; i < 10; i++) {
+   CHACHA20_QR(x[0], x[4], x[8],  x[12])
+   CHACHA20_QR(x[1], x[5], x[9],  x[13])
+   CHACHA20_QR(x[2], x[6], x[10], x[14])
+   CHACHA20_QR(x[3], x[7], x[11], x[15])
+   CHACHA20_QR(x[0], x[5], x[10], x[15])
+   CHACHA20_QR(x[1], x[6], x[11], x[12])
+   CHACHA20_QR(x[2], x[7], x[8],  x[13])
+   CHACHA20_QR(x[3], x[4], x[9],  x[14])
+ }
+
+ for(i = 0; i < 16; i++) {
+   x[i] += st[i];
+   out[4 * i]     = (unsigned char)x[i];
+   out[4 * i + 1] = (unsigned char)(x[i] >> 8);
+   out[4 * i + 2] = (unsigned char)(x[i] >> 16);
+   out[4 * i + 3] = (unsigned char)(x[i] >> 24);
+ }
+}
+
+static inline void chacha20_blocks_ref(uint32_t st[16], unsigned char *buf, size_t nblocks) {
+ unsigned char ks[64];
+ int i;
+
+ for(; nblocks; nblocks--, buf += 64) {
+   chacha20_block(st, ks);
+   for(i = 0; i < 64; i++)
+     buf[i] ^= ks[i];
+   st[12]++;
+ }
+}
+
+#ifdef CHACHA20_X86
+
+/* The SIMD kernels keep word j of 8 (or 16) consecutive blocks in vector x[j]. After the  *
+ * rounds, each group of 4 words is transposed so that every 128 bit lane holds 4 words of *
+ * one block, and those lanes are then reassembled into whole blocks.                      */
+
+#define CHACHA20_QR_V(a, b, c, d, ADD, XOR, ROT)                           \
+ a = ADD(a, b); d = XOR(d, a); d = ROT(d, 16);                           \
+ c = ADD(c, d); b = XOR(b, c); b = ROT(b, 12);                           \
+ a = ADD(a, b); d = XOR(d, a); d = ROT(d, 8);                            \
+ c = ADD(c, d); b = XOR(b, c); b = ROT(b, 7);
+
+#define CHACHA20_ROUNDS_V(x, ADD, XOR, ROT)                                \
+ for(i = 0; i < 10; i++) {                                                 \
+   CHACHA20_QR_V(x[0], x[4], x[8],  x[12], ADD, XOR, ROT)                  \
+   CHACHA20_QR_V(x[1], x[5], x[9],  x[13], ADD, XOR, ROT)                  \
+   CHACHA20_QR_V(x[2], x[6], x[10], x[14], ADD, XOR, ROT)                  \
+   CHACHA20_QR_V(x[3], x[7], x[11], x[15], ADD, XOR, ROT)                  \
+   CHACHA20_QR_V(x[0], x[5], x[10], x[15], ADD, XOR, ROT)                  \
+   CHACHA20_QR_V(x[1], x[6], x[11], x[12], ADD, XOR, ROT)                  \
+   CHACHA20_QR_V(x[2], x[7], x[8],  x[13], ADD, XOR, ROT)                  \
+   CHACHA20_QR_V(x[3], x[4], x[9],  x[14], ADD, XOR, ROT)                  \
+ }
+
+__attribute__((target("avx2")))
+static inline __m256i chacha20_rot_avx2(__m256i v, int n) {
+ if(n == 16)
+   return _mm256_shuffle_epi8(v, _mm256_set_epi8(13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2,
+                                                 13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2));
+ if(n == 8)
+   return _mm256_shuffle_epi8(v, _mm256_set_epi8(14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3,
+                                                 14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3));
+ return _mm256_or_si256(_mm256_slli_epi32(v, n), _mm256_srli_epi32(v, 32 - n));
+}
+
+__attribute__((target("avx2")))
+static inline void chacha20_blocks_avx2(uint32_t st[16], unsigned char *buf, size_t nblocks) {
+ __m256i x[16], s[16], t0, t1, t2, t3, q[4][4];
+ int i, j, g;
+
+ for(; nblocks >= 8; nblocks -= 8, buf += 512) {
+   for(j = 0; j < 16; j++)
+     s[j] = _mm256_set1_epi32((int)st[j]);
+   s[12] = _mm256_add_epi32(s[12], _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+
+   memcpy(x, s, sizeof(x));
+   CHACHA20_ROUNDS_V(x, _mm256_add_epi32, _mm256_xor_si256, chacha20_rot_avx2)
+
+   for(g = 0; g < 4; g++) {
+     for(j = 0; j < 4; j++)
+       x[4 * g + j] = _mm256_add_epi32(x[4 * g + j], s[4 * g + j]);
+     t0 = _mm256_unpacklo_epi32(x[4 * g],     x[4 * g + 1]);
+     t1 = _mm256_unpackhi_epi32(x[4 * g],     x[4 * g + 1]);
+     t2 = _mm256_unpacklo_epi32(x[4 * g + 2], x[4 * g + 3]);
+     t3 = _mm256_unpackhi_epi32(x[4 * g + 2], x[4 * g + 3]);
+     q[g][0] = _mm256_unpacklo_epi64(t0, t2);
+     q[g][1] = _mm256_unpackhi_epi64(t0, t2);
+     q[g][2] = _mm256_unpacklo_epi64(t1, t3);
+     q[g][3] = _mm256_unpackhi_epi64(t1, t3);
+   }
+
+   /* lane L of q[g][b] holds words 4g..4g+3 of block 4L+b */
+   for(j = 0; j < 4; j++) {
+     unsigned char *lo = buf + 64 * j, *hi = buf + 64 * (j + 4);
+     __m256i *p;
+
+     p = (__m256i*)lo;
+     _mm256_storeu_si256(p, _mm256_xor_si256(_mm256_loadu_si256(p), _mm256_permute2x128_si256(q[0][j], q[1][j], 0x20)));
+     p = (__m256i*)(lo + 32);
+     _mm256_storeu_si256(p, _mm256_xor_si256(_mm256_loadu_si256(p), _mm256_permute2x128_si256(q[2][j], q[3][j], 0x20)));
+     p = (__m256i*)hi;
+     _mm256_storeu_si256(p, _mm256_xor_si256(_mm256_loadu_si256(p), _mm256_permute2x128_si256(q[0][j], q[1][j], 0x31)));
+     p = (__m256i*)(hi + 32);
+     _mm256_storeu_si256(p, _mm256_xor_si256(_mm256_loadu_si256(p), _mm256_permute2x128_si256(q[2][j], q[3][j], 0x31)));
+   }
+
+   st[12] += 8;
+ }
+
+ chacha20_blocks_ref(st, buf, nblocks);
+}
+
+__attribute__((target("avx512f")))
+static inline __m512i chacha20_rot_avx512(__m512i v, int n) {
+ switch(n) {
+   case 16: return _mm512_rol_epi32(v, 16);
+   case 12: return _mm512_rol_epi32(v, 12);
+   case 8:  return _mm512_rol_epi32(v, 8);
+   default: return _mm512_rol_epi32(v, 7);
+ }
+}
+
+__attribute__((target("avx512f")))
+static inline void chacha20_blocks_avx512(uint32_t st[16], unsigned char *buf, size_t nblocks) {
+ __m512i x[16], s[16], t0, t1, t2, t3, q[4][4], a, b, c, d;
+ int i, j, g;
+
+ for(; nblocks >= 16; nblocks -= 16, buf += 1024) {
+   for(j = 0; j < 16; j++)
+     s[j] = _mm512_set1_epi32((int)st[j]);
+   s[12] = _mm512_add_epi32(s[12], _mm512_set_epi32(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0));
+
+   memcpy(x, s, sizeof(x));
+   CHACHA20_ROUNDS_V(x, _mm512_add_epi32, _mm512_xor_si512, chacha20_rot_avx512)
+
+   for(g = 0; g < 4; g++) {
+     for(j = 0; j < 4; j++)
+       x[4 * g + j] = _mm512_add_epi32(x[4 * g + j], s[4 * g + j]);
+     t0 = _mm512_unpacklo_epi32(x[4 * g],     x[4 * g + 1]);
+     t1 = _mm512_unpackhi_epi32(x[4 * g],     x[4 * g + 1]);
+     t2 = _mm512_unpacklo_epi32(x[4 * g + 2], x[4 * g + 3]);
+     t3 = _mm512_unpackhi_epi32(x[4 * g + 2], x[4 * g + 3]);
+     q[g][0] = _mm512_unpacklo_epi64(t0, t2);
+     q[g][1] = _mm512_unpackhi_epi64(t0, t2);
+     q[g][2] = _mm512_unpacklo_epi64(t1, t3);
+     q[g][3] = _mm512_unpackhi_epi64(t1, t3);
+   }
+
+   /* lane L of q[g][j] holds words 4g..4g+3 of block 4L+j - a 4x4 transpose of the *
+    * lanes of q[0..3][j] gathers each of those 4 blocks into a single vector.      */
+   for(j = 0; j < 4; j++) {
+     __m512i o[4];
+
+     a = _mm512_shuffle_i32x4(q[0][j], q[1][j], 0x44);
+     b = _mm512_shuffle_i32x4(q[0][j], q[1][j], 0xee);
+     c = _mm512_shuffle_i32x4(q[2][j], q[3][j], 0x44);
+     d = _mm512_shuffle_i32x4(q[2][j], q[3][j], 0xee);
+     o[0] = _mm512_shuffle_i32x4(a, c, 0x88);
+     o[1] = _mm512_shuffle_i32x4(a, c, 0xdd);
+     o[2] = _mm512_shuffle_i32x4(b, d, 0x88);
+     o[3] = _mm512_shuffle_i32x4(b, d, 0xdd);
+
+     for(g = 0; g < 4; g++) {
+       unsigned char *p = buf + 64 * (4 * g + j);
+       _mm512_storeu_si512(p, _mm512_xor_si512(_mm512_loadu_si512(p), o[g]));
+     }
+   }
+
+   st[12] += 16;
+ }
+
+ chacha20_blocks_ref(st, buf, nblocks);
+}
+
+#endif
+
+static chacha20_fn chacha20_kernel = NULL;
+static const char *chacha20_kernel_name = "none";
+
+/* Choose the fastest kernel that this CPU supports. */
+static inline void chacha20_pick(void) {
+ chacha20_kernel = chacha20_blocks_ref;
+ chacha20_kernel_name = "portable";
+#ifdef CHACHA20_X86
+ __builtin_cpu_init();
+ if(__builtin_cpu_supports("avx512f")) {
+   chacha20_kernel = chacha20_blocks_avx512;
+   chacha20_kernel_name = "avx512";
+ }
+ else if(__builtin_cpu_supports("avx2")) {
+   chacha20_kernel = chacha20_blocks_avx2;
+   chacha20_kernel_name = "avx2";
+ }
+#endif
+}
+
+/* Use the kernel called name ("portable", "avx2" or "avx512") instead - if this CPU *
+ * supports it. Returns non-zero, leaving the choice alone, if it doesn't.            */
+static inline int chacha20_use(const char *name) {
+ if(!strcmp(name, "portable")) {
+   chacha20_kernel = chacha20_blocks_ref;
+   chacha20_kernel_name = "portable";
+   return 0;
+ }
+#ifdef CHACHA20_X86
+ __builtin_cpu_init();
+ if(!strcmp(name, "avx2") && __builtin_cpu_supports("avx2")) {
+   chacha20_kernel = chacha20_blocks_avx2;
+   chacha20_kernel_name = "avx2";
+   return 0;
+ }
+ if(!strcmp(name, "avx512") && __builtin_cpu_supports("avx512f")) {
+   chacha20_kernel = chacha20_blocks_avx512;
+   chacha20_kernel_name = "avx512";
+   return 0;
+ }
+#endif
+ return 1;
+}
+
+/* XOR the len bytes at buf with the keystream for key and nonce, starting pos bytes *
+ * into that keystream. pos + len must not exceed 256 GiB (2^32 blocks).             */
+static inline void chacha20_xor(const unsigned char key[32], const unsigned char nonce[12],
+                                uint64_t pos, unsigned char *buf, size_t len) {
+ uint32_t st[16];
+ unsigned char ks[64];
+ size_t i, skip, n;
+
+ if(chacha20_kernel == NULL) chacha20_pick();
+
+ chacha20_init(st, key, nonce, (uint32_t)(pos / 64));
+
+ skip = (size_t)(pos % 64);
+ if(skip && len) {
+   chacha20_block(st, ks);
+   st[12]++;
+   n = len < 64 - skip ? len : 64 - skip;
+   for(i = 0; i < n; i++)
+     buf[i] ^= ks[skip + i];
+   buf += n;
+   len -= n;
+ }
+
+ chacha20_kernel(st, buf, len / 64);
+ buf += len - len % 64;
+ len %= 64;
+
+ if(len) {
+   chacha20_block(st, ks);
+   for(i = 0; i < len; i++)
+     buf[i] ^= ks[i];
+ }
+}
+
+/* Check every kernel this CPU supports against the RFC 8439 known answers. *
+ * Returns 0 if they all agree, otherwise prints the culprit and returns 1. */
+static inline int chacha20_selftest(void) {
+ /* RFC 8439 2.3.2: key 00..1f, nonce 00:00:00:09:00:00:00:4a:00:00:00:00, counter 1 */
+ static const unsigned char block_kat[64] = {
+   0x10, 0xf1, 0xe7, 0xe4, 0xd1, 0x3b, 0x59, 0x15, 0x50, 0x0f, 0xdd, 0x1f, 0xa3, 0x20, 0x71, 0xc4,
+   0xc7, 0xd1, 0xf4, 0xc7, 0x33, 0xc0, 0x68, 0x03, 0x04, 0x22, 0xaa, 0x9a, 0xc3, 0xd4, 0x6c, 0x4e,
+   0xd2, 0x82, 0x64, 0x46, 0x07, 0x9f, 0xaa, 0x09, 0x14, 0xc2, 0xd7, 0x05, 0xd9, 0x8b, 0x02, 0xa2,
+   0xb5, 0x12, 0x9c, 0xd1, 0xde, 0x16, 0x4e, 0xb9, 0xcb, 0xd0, 0x83, 0xe8, 0xa2, 0x50, 0x3c, 0x4e };
+ /* RFC 8439 2.4.2: same key, nonce 00:00:00:00:00:00:00:4a:00:00:00:00, counter 1 */
+ static const char sunscreen[] = "Ladies and Gentlemen of the class of '99: If I could offer you "
+                                 "only one tip for the future, sunscreen would be it.";
+ static const unsigned char sunscreen_kat[114] = {
+   0x6e, 0x2e, 0x35, 0x9a, 0x25, 0x68, 0xf9, 0x80, 0x41, 0xba, 0x07, 0x28, 0xdd, 0x0d, 0x69, 0x81,
+   0xe9, 0x7e, 0x7a, 0xec, 0x1d, 0x43, 0x60, 0xc2, 0x0a, 0x27, 0xaf, 0xcc, 0xfd, 0x9f, 0xae, 0x0b,
+   0xf9, 0x1b, 0x65, 0xc5, 0x52, 0x47, 0x33, 0xab, 0x8f, 0x59, 0x3d, 0xab, 0xcd, 0x62, 0xb3, 0x57,
+   0x16, 0x39, 0xd6, 0x24, 0xe6, 0x51, 0x52, 0xab, 0x8f, 0x53, 0x0c, 0x35, 0x9f, 0x08, 0x61, 0xd8,
+   0x07, 0xca, 0x0d, 0xbf, 0x50, 0x0d, 0x6a, 0x61, 0x56, 0xa3, 0x8e, 0x08, 0x8a, 0x22, 0xb6, 0x5e,
+   0x52, 0xbc, 0x51, 0x4d, 0x16, 0xcc, 0xf8, 0x06, 0x81, 0x8c, 0xe9, 0x1a, 0xb7, 0x79, 0x37, 0x36,
+   0x5a, 0xf9, 0x0b, 0xbf, 0x74, 0xa3, 0x5b, 0xe6, 0xb4, 0x0b, 0x8e, 0xed, 0xf2, 0x78, 0x5e, 0x42,
+   0x87, 0x4d };
+ static const unsigned char nonce1[12] = { 0, 0, 0, 9, 0, 0, 0, 0x4a, 0, 0, 0, 0 };
+ static const unsigned char nonce2[12] = { 0, 0, 0, 0, 0, 0, 0, 0x4a, 0, 0, 0, 0 };
+ chacha20_fn kernels[3];
+ const char *names[3];
+ unsigned char key[32], ref[17 * 64], buf[17 * 64], msg[114];
+ uint32_t st[16];
+ int i, n = 0;
+
+ for(i = 0; i < 32; i++)
+   key[i] = (unsigned char)i;
+
+ kernels[n] = chacha20_blocks_ref; names[n++] = "portable";
+#ifdef CHACHA20_X86
+ __builtin_cpu_init();
+ if(__builtin_cpu_supports("avx2")) {
+   kernels[n] = chacha20_blocks_avx2; names[n++] = "avx2";
+ }
+ if(__builtin_cpu_supports("avx512f")) {
+   kernels[n] = chacha20_blocks_avx512; names[n++] = "avx512";
+ }
+#endif
+
+ /* 17 blocks from counter 1: the first must match the KAT, and every kernel must agree *
+  * with the portable code across a full SIMD batch plus a leftover block.              */
+ memset(ref, 0, sizeof(ref));
+ chacha20_init(st, key, nonce1, 1);
+ chacha20_blocks_ref(st, ref, 17);
+
+ for(i = 0; i < n; i++) {
+   memset(buf, 0, sizeof(buf));
+   chacha20_init(st, key, nonce1, 1);
+   kernels[i](st, buf, 17);
+   if(memcmp(buf, block_kat, 64) || memcmp(buf, ref, sizeof(ref)) || st[12] != 18) {
+     printf("ChaCha20 %s kernel failed its known answer test.\n", names[i]);
+     return 1;
+   }
+ }
+
+ memcpy(msg, sunscreen, sizeof(msg));
+ chacha20_xor(key, nonce2, 64, msg, sizeof(msg));
+ if(memcmp(msg, sunscreen_kat, sizeof(msg))) {
+   printf("ChaCha20 failed the RFC 8439 encryption known answer test.\n");
+   return 1;
+ }
+
+ return 0;
+}
+
+#endif
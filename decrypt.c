@@ -3,7 +3,7 @@
  * The gmp library (https://gmplib.org) is required.                                       *
  *                                                                                         *
  * I build decrypt.exe with: gcc -o decrypt.exe decrypt.c -lgmp                            *
- * Usage: decrypt.exe                                                                      *
+ * Usage: decrypt.exe [DEBUG] [DIRECT] [STDIO] [JOURNAL [secs] | BATCH file ...]           *
  *                                                                                         *
  * Upon execution, the contents of "msg.enc" are decrypted in a way that's based on the    *
  * contents of "primes.in", and the decrypted material is then written to "msg.dec".       *
@@ -13,344 +13,226 @@
  * Additional "DEBUG" output can be obtained by running "decrypt.exe DEBUG" instead of     *
  * simply "decrypt.exe".                                                                   *
  *                                                                                         *
+ * If the header of "msg.enc" shows that encrypt.exe compressed the message (see otpz.h)   *
+ * then the decrypted material is decompressed before being written to "msg.dec".         *
+ * Likewise, if it shows that the message was encrypted in HYBRID mode, the pad is used    *
+ * only as the key and nonce of the ChaCha20 keystream (see chacha20.h).                   *
+ *                                                                                         *
+ * As with encrypt.exe, "DIRECT" reads and writes with O_DIRECT, and "STDIO" avoids the    *
+ * io_uring code in otpio.h. An "otp.tune" from otptune.exe is used as by encrypt.exe.     *
+ *                                                                                         *
+ * "BATCH" (which must come last) is followed by the names of any number of files written  *
+ * by "encrypt.exe BATCH". Each is decrypted to its name with ".enc" replaced by ".dec"    *
+ * (or with ".dec" appended), with the pads generated side by side as in encrypt.exe.      *
+ *                                                                                         *
+ * "JOURNAL" checkpoints a long decryption as it does a long encryption (see encrypt.c and *
+ * otpjournal.h): "msg.dec" is written as it's determined, progress is kept in            *
+ * "msg.dec.journal", and "decrypt.exe JOURNAL" run again carries on from the last         *
+ * checkpoint. The journal is removed once "msg.dec" is complete.                          *
+ *                                                                                         *
  *******************************************************************************************/
 
+#define _GNU_SOURCE /* for O_DIRECT in otpio.h */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <malloc.h>
 #include <gmp.h>
+#include "otp.h"
+#include "otpz.h"
+#include "chacha20.h"
+#include "otpio.h"
+#include "msmb.h"
+#include "otpmsg.h"
+#include "otpjournal.h"
+#include "otptune.h"
+
+/* One of the files being decrypted. */
+typedef struct {
+ const char *in_name, *out_name;
+ size_t enc_len;
+ otp_msg m;
+} dec_msg;
 
 int main(int argc, char *argv[]) {
- FILE *fp;
- int i_seed, i_count, i_bitsize, base, i;
- struct stat stbuf;
- struct stat p_stbuf;
+ int i, nmsg = 1, hybrid = 0;
+ int debug = 0, journal = 0, secs = OTP_JOURNAL_SECS;
  struct stat d_stbuf;
- char seed_buf[11];
- char tmp[12];
- char *msg_buf, *tmp_buf, *chk_buf, *dec_buf, *prime_buf;
- mpz_t z_enc, z_dec, z_pad, z_mod, z_keep;
- size_t bitsize, r_shift, its, count, bytesize, ret;
- mpz_t z_phi, pless1, qless1;
- mpz_t z_seed, p, q;
- unsigned int N, k, e, check, r;
- double kdoub;
-
- stat("primes.in", &p_stbuf);
-
- prime_buf = malloc(1 + p_stbuf.st_size);
-
- if(prime_buf == NULL) {
-   printf("Failed to allocate memory to prime_buf.\n");
-   exit(1);
- }
-
-/**** START SETTING PRIMES ****/
-
- fp = fopen("primes.in", "r");
-
- if(fp == NULL) {
-   printf("Error while opening primes.in for reading.\n");
-   exit(1);
+ char *z_buf;
+ size_t m, len;
+ mpz_t z_seed;
+ otp_key key;
+ dec_msg *msgs, *msg;
+ otp_gen **gens;
+ otpio_file *files;
+ msmb_ctx *mb;
+ char **names = NULL;
+ otp_journal jn;
+
+ for(i = 1; i < argc; i++) {
+   if(!strcmp(argv[i], "DEBUG")) debug = 1;
+   else if(!strcmp(argv[i], "DIRECT")) otpio_direct = 1;
+   else if(!strcmp(argv[i], "STDIO")) otpio_mode = OTPIO_STDIO;
+   else if(!strcmp(argv[i], "JOURNAL")) {
+     journal = 1;
+     if(i + 1 < argc && argv[i + 1][0] >= '0' && argv[i + 1][0] <= '9') secs = atoi(argv[++i]);
+   }
+   else if(!strcmp(argv[i], "BATCH") && i + 1 < argc && !journal) {
+     names = argv + i + 1;
+     nmsg = argc - i - 1;
+     break;
+   }
+   else {
+     printf("Usage: decrypt.exe [DEBUG] [DIRECT] [STDIO] [JOURNAL [secs] | BATCH file ...]\n");
+     exit(1);
+   }
  }
 
- fgets(prime_buf, p_stbuf.st_size, fp);
- base = atoi(prime_buf);
- if(base < 2 || base > 32) {
-   printf("value specified for base (%d) is outside of allowable range of 2 to 32.\n", base);
+ msgs = calloc(nmsg, sizeof(dec_msg));
+ gens = malloc(nmsg * sizeof(otp_gen*));
+ files = calloc(nmsg, sizeof(otpio_file));
+ mb = malloc(sizeof(msmb_ctx));
+ if(msgs == NULL || gens == NULL || files == NULL || mb == NULL) {
+   printf("Failed to allocate memory for %d messages.\n", nmsg);
    exit(1);
  }
 
- fgets(prime_buf, p_stbuf.st_size, fp);
- mpz_init_set_str(p, prime_buf, base);
-
- if(mpz_sizeinbase(p, 2) <= 500) {
-   printf("Bitsize of first prime(%d) needs to be geater than 500.\n", (int)mpz_sizeinbase(p, 2));
-   exit(1);
- }
+ for(m = 0; m < nmsg; m++) {
+   msg = msgs + m;
+   if(names == NULL) {
+     msg->in_name = "msg.enc";
+     msg->out_name = "msg.dec";
+   }
+   else {
+     msg->in_name = names[m];
+     len = strlen(names[m]);
+     if(len > 4 && !strcmp(names[m] + len - 4, ".enc")) len -= 4;
+     z_buf = malloc(len + 5);
+     if(z_buf == NULL) {
+       printf("Failed to allocate memory to output file name.\n");
+       exit(1);
+     }
+     memcpy(z_buf, names[m], len);
+     strcpy(z_buf + len, ".dec");
+     msg->out_name = z_buf;
+   }
 
- fgets(prime_buf, p_stbuf.st_size, fp);
- mpz_init_set_str(q, prime_buf, base);
+   if(otpio_size(msg->in_name, &msg->enc_len, 536870912)) exit(1);
 
- if(mpz_sizeinbase(q, 2) <= 500) {
-   printf("Bitsize of second prime(%d) needs to be geater than 500.\n", (int)mpz_sizeinbase(q, 2));
-   exit(1);
- }
+   z_buf = otpio_alloc(msg->enc_len);
+   if(z_buf == NULL) {
+     printf("Failed to allocate memory to read %s.\n", msg->in_name);
+     exit(1);
+   }
 
- fclose(fp);
- free(prime_buf);
+   otp_msg_init(&msg->m, z_buf, msg->enc_len);
+   msg->m.debug = debug;
 
- if(mpz_sizeinbase(p, 2) == mpz_sizeinbase(q, 2)) {
-   printf("Must select primes that differ in bitsize.\n");
-   exit(1);
+   files[m].fname = msg->in_name;
+   files[m].buf = z_buf;
+   files[m].len = msg->enc_len;
  }
 
- if(!mpz_probab_prime_p(p, 50)) {
-   printf("First prime is NOT prime.\n");
-   mpz_out_str(stdout, base, p);
-   printf("\n");
-   exit(1);
- }
+/**** START SETTING PRIMES ****/
 
- if(!mpz_probab_prime_p(q, 50)) {
-   printf("Second prime is NOT prime.\n");
-   mpz_out_str(stdout, base, q);
-   printf("\n");
-   exit(1);
- }
+ if(otp_load_key("primes.in", &key)) exit(1);
+ otp_tune_use(&key, debug);
 
 /****  END SETTING OF PRIMES  ****/
 
- fp = fopen("msg.enc", "rb");
-
- if(fp == NULL) {
-   printf("Error while opening msg.enc for reading.\n");
-   exit(1);
- }
-
- stat("msg.enc", &stbuf);
-
- if(stbuf.st_size > 536870912) {
-   printf("This program cannot reliably deal with an 'msg.enc' whose size is greater than 536,870,912 bytes.\n");
-   exit(1);
- }
-
- msg_buf = malloc(1 + stbuf.st_size);
- if(msg_buf == NULL) {
-   printf("Failed to allocate memory to msg_buf.\n");
-   exit(1);
- }
-
- tmp_buf = malloc(1 + stbuf.st_size);
- if(tmp_buf == NULL) {
-   printf("Failed to allocate memory to tmp_buf.\n");
-   exit(1);
- }
+ if(otpio_transfer(files, nmsg)) exit(1);
 
- chk_buf = malloc(1 + stbuf.st_size);
- if(chk_buf == NULL) {
-   printf("Failed to allocate memory to chk_buf.\n");
-   exit(1);
- }
-
- msg_buf[0] = 0;
- tmp[11] = 0;
+ mpz_init(z_seed);
 
- ret = fread(msg_buf, 1, stbuf.st_size, fp);
+ for(m = 0; m < nmsg; m++) {
+   msg = msgs + m;
+   msg->m.file_buf[msg->enc_len] = 0;
 
- if(ret != stbuf.st_size) {
-   printf("'msg.enc' contains %d bytes but %d were read to msg_buf.\n", (int)stbuf.st_size, (int)ret);
-   exit(1);
- }
-
- msg_buf[stbuf.st_size] = 0;
-
- fclose(fp);
-
- if(msg_buf[0] != '1' || msg_buf[10] != '?') {
-   strncpy(tmp, msg_buf, 11);
-   printf("Error at beginning of msg.enc:\n<%s>\n", tmp);
-   exit(1);
- }
+   if(names != NULL) printf("%s:\n", msg->in_name);
 
- for(i = 0; msg_buf[i] != '?'; i++)
-   tmp[i] = msg_buf[i];
+   if(otp_msg_parse(&msg->m, msg->in_name)) exit(1);
 
- tmp[i] = 0;
- i_seed = atoi(tmp);
- printf("seed: %d\n", i_seed);
- printf("sizeof 'msg.enc': %d\n", (int)stbuf.st_size);
+   printf("seed: %d\n", msg->m.i_seed);
+   printf("sizeof '%s': %d\n", msg->in_name, (int)msg->enc_len);
+   printf("derived bitsize of message: %d\n", msg->m.i_bitsize);
 
- msg_buf += i + 1;
-
- for(i = 0; msg_buf[i] != '#'; i++)
-   tmp[i] = msg_buf[i];
-
- tmp[i] = 0;
- i_count = atoi(tmp);
-
- msg_buf += i + 1;
-
- for(i = 0; msg_buf[i] != '*'; i++)
-   tmp[i] = msg_buf[i];
-
- tmp[i] = 0;
- i_bitsize = (i_count * 8) - atoi(tmp);
- printf("derived bitsize of message: %d\n", i_bitsize);
-
- msg_buf += i + 1;
-
- mpz_init(z_enc);
-
- msg_buf[i_count] = 0;
-
- mpz_import(z_enc, i_count, 1, 1, 0, 0, msg_buf);
-
- if(argc > 1 && !strcmp(argv[1], "DEBUG")) {
-   printf("ENCRYPTED MESSAGE:\n");
-   mpz_out_str(stdout, 16, z_enc);
-   printf("\n\n");
- }
-
- bitsize = i_bitsize;
-
- mpz_export(chk_buf, &count, 1, 1, 0, 0, z_enc);
- chk_buf[count] = 0;
-
- if(strcmp(msg_buf, chk_buf)) {
-   printf("<%s>\nIS NOT:\n<%s>\n", msg_buf, chk_buf);
-   exit(1);
- }
+   if(msg->m.flags & OTP_HYBRID) hybrid = 1;
 
 /**** START SEED GEN ****/
 
- mpz_init_set_si(z_seed, i_seed);
-
- if(mpz_cmp_si(z_seed, 0) < 0) {
-   printf("Negative seed in seed gen.\n");
-   exit(1);
- }
-
- mpz_init(z_phi);
- mpz_init(pless1);
- mpz_init(qless1);
+   if(otp_seed(&key, msg->m.i_seed, z_seed)) exit(1);
 
- mpz_sub_ui(qless1, q, 1);
- mpz_sub_ui(pless1, p, 1);
-
- mpz_mul(z_phi, p, q);
+   if(debug) {
+     printf("HEX SEED:\n");
+     mpz_out_str(stdout, 16, z_seed);
+     printf("\n");
+   }
 
- N = mpz_sizeinbase(z_phi, 2);
- e = N / 80;
- if(!(e & 1)) --e;
+/****  END SEED GEN  ****/
 
- if(e < 3) {
-   printf("You need to choose different primes P and Q. The product of P and Q needs to be at least a 240-bit number");
-   exit(1);
- }
+   if(otp_dec_begin(&key, &msg->m, z_seed)) exit(1);
 
- mpz_mul(z_phi, pless1, qless1);
- mpz_clear(pless1);
- mpz_clear(qless1);
+   /* A HYBRID pad is a single step, so there's nothing to journal. */
+   if(msg->m.flags & OTP_HYBRID) journal = 0;
 
- while(1) {
-   if(mpz_gcd_ui(NULL, z_phi, e) == 1) break;
-   e -= 2;
-   if(e < 3) {
-     printf("The chosen primes are unsuitable in seed gen function. Select other primes P ad Q\n");
-     exit(1);
+   if(journal) {
+     otp_journal_init(&jn, "msg.dec.journal", msg->out_name, 0, secs);
+     if(otp_journal_load(&jn) > 0 || otp_journal_start(&key, &jn, &msg->m)) exit(1);
    }
- }
-
- kdoub = (double) 2 / (double)e;
- kdoub = (double) 1 - kdoub;
- kdoub *= (double) N;
- k = (int)kdoub;
- r = N - k;
 
- while(mpz_sizeinbase(z_seed, 2) < r) {
-   mpz_mul_2exp(z_seed, z_seed, 1);
-   if(mpz_sizeinbase(z_seed, 2) & 3)
-     mpz_add_ui(z_seed, z_seed, 1);
+   gens[m] = &msg->m.gen;
  }
 
- if(mpz_sizeinbase(z_seed, 2) != r) {
-   printf("The size of the seed (%d) being used should be %d.\n", (int)mpz_sizeinbase(z_seed, 2), r);
-   exit(1);
- }
+ mpz_clear(z_seed);
 
-
-/****  END SEED GEN  ****/
 /****  START PAD GEN ****/
 
- r_shift = bitsize % k;
+ if(nmsg >= msmb_min_lanes) msmb_init(mb, &key);
+ else mb->use = 0;
 
- if(r_shift) its = (bitsize / k) + 1;
- else its = bitsize / k;
+ if(journal) otp_journal_run(&key, &jn, &msgs[0].m);
+ else msmb_run(mb, &key, gens, nmsg);
 
- if(its < 1) {
-   printf("At least one iteration must be done.\n");
-   exit(1);
- }
-
-  if(argc > 1 && !strcmp(argv[1], "DEBUG")) {
-   printf("HEX SEED:\n");
-   mpz_out_str(stdout, 16, z_seed);
-   printf("\n");
- }
+ if(debug) printf("MicaliSchnorr kernel: %s\n", mb->use ? msmb_kernel_name : "gmp");
 
- mpz_init(z_mod);
- mpz_init(z_keep);
- mpz_init_set_ui(z_pad, 0);
- mpz_ui_pow_ui(z_mod, 2, k);
-
- for(i = 0; i < its; ++i) {
-   mpz_powm_ui(z_seed, z_seed, e, z_phi);
-   mpz_mod(z_keep, z_seed, z_mod);
-   mpz_mul_2exp(z_pad, z_pad, k);
-   mpz_add(z_pad, z_pad, z_keep);
-   mpz_fdiv_q_2exp(z_seed, z_seed, k);
- }
+/****  END PAD GEN   ****/
 
- mpz_clear(z_phi);
- mpz_clear(z_keep);
- mpz_clear(z_mod);
+ if(hybrid && chacha20_selftest()) exit(1);
 
- if(r_shift) mpz_fdiv_q_2exp(z_pad, z_pad, k - r_shift);
+ for(m = 0; m < nmsg; m++) {
+   msg = msgs + m;
 
- bitsize = mpz_sizeinbase(z_pad, 2);
+   if(otp_dec_end(&key, &msg->m)) exit(1);
 
- if(argc > 1 && !strcmp(argv[1], "DEBUG")) {
-   printf("PAD:\n");
-   mpz_out_str(stdout, 16, z_pad);
-   printf("\n\n");
+   memset(&files[m], 0, sizeof(otpio_file));
+   files[m].fname = msg->out_name;
+   files[m].buf = msg->m.out_buf;
+   files[m].len = msg->m.out_len;
+   files[m].write = 1;
  }
 
-/****  END PAD GEN   ****/
-
- mpz_init(z_dec);
- mpz_xor(z_dec, z_enc, z_pad);
-
- if(argc > 1 && !strcmp(argv[1], "DEBUG")) {
-   printf("bitsize of encrypted message: %d\n", (int)mpz_sizeinbase(z_enc, 2));
-   printf("bitsize of pad: %d\n", (int)mpz_sizeinbase(z_pad, 2));
-   printf("bitsize of decrypted message: %d\n", (int)mpz_sizeinbase(z_dec, 2));
- }
+ mpz_clear(key.z_phi);
 
- if(argc > 1 && !strcmp(argv[1], "DEBUG")) {
-   printf("DECRYPTED MESSAGE:\n");
-   mpz_out_str(stdout, 16, z_dec);
-   printf("\n\n");
+ if(journal) {
+   if(otp_journal_end(&jn, msgs[0].m.out_buf, msgs[0].m.out_len)) exit(1);
+   otp_journal_clear(&jn);
  }
+ else if(otpio_transfer(files, nmsg)) exit(1);
 
- bitsize = mpz_sizeinbase(z_dec, 2);
-
- bytesize = bitsize / 8;
- if(bitsize % 8) bytesize++;
+ for(m = 0; m < nmsg; m++) {
+   msg = msgs + m;
 
- dec_buf = malloc(1 + bytesize);
+   if(debug) printf("%d bytes written to %s (%s)\n", (int)msg->m.out_len, msg->out_name, otpio_used);
 
- mpz_export(dec_buf, &count, 1, 1, 0, 0, z_dec);
- dec_buf[count] = 0;
-
- fp = fopen("msg.dec", "wb");
-
- ret = fwrite(dec_buf, 1, bytesize, fp);
+   if(stat(msg->out_name, &d_stbuf)) {
+     printf("Unable to stat %s.\n", msg->out_name);
+     exit(1);
+   }
 
- if(ret < bytesize) {
-   printf("ret: %d < %d\n", (int)ret, (int)bytesize);
-   exit(1);
+   printf("sizeof '%s': %d\n", msg->out_name, (int)d_stbuf.st_size);
  }
 
- fclose(fp);
-
- stat("msg.dec", &d_stbuf);
-
- printf("sizeof 'msg.dec': %d\n", (int)d_stbuf.st_size);
-
  return 0;
 
 }
-
@@ -3,7 +3,8 @@
  * The gmp library (https://gmplib.org) is required.                                       *
  *                                                                                         *
  * I build encrypt.exe with: gcc -o encrypt.exe encrypt.c -lgmp                            *
- * Usage: encrypt.exe                                                                      *
+ * Usage: encrypt.exe [DEBUG] [COMPRESS] [HYBRID] [DIRECT] [STDIO]                         *
+ *                    [APPEND | JOURNAL [secs] | BATCH file ...]                            *
  *                                                                                         *
  * Upon execution, the contents of "msg.in" are encrypted in a way that's based on the     *
  * contents of "primes.in" and "next_seed.txt". The encrypted message is then written to   *
@@ -14,6 +15,53 @@
  * Additional "DEBUG" output can be obtained by running "encrypt.exe DEBUG" instead of     *
  * simply "encrypt.exe".                                                                   *
  *                                                                                         *
+ * Running "encrypt.exe COMPRESS" (optionally along with "DEBUG") first compresses the     *
+ * contents of "msg.in" with the codec in otpz.h, and it's that compressed stream which is *
+ * then encrypted. This saves both keystream generation and output size for compressible  *
+ * (eg text) messages. If compression doesn't shrink "msg.in", the message is encrypted    *
+ * as is. decrypt.exe sees from the header of "msg.enc" whether it needs to decompress.    *
+ * "msg.in" is compressed a block at a time as it's read (stdio, whatever the I/O options) *
+ * so that it's never held in memory in full beside its compressed form.                   *
+ *                                                                                         *
+ * Running "encrypt.exe HYBRID" takes only the first 352 bits of the MicaliSchnorr pad,    *
+ * and uses them as the key and nonce of a ChaCha20 keystream (see chacha20.h) which is    *
+ * then XOR'd with the message. That's many times quicker for large messages, and the     *
+ * security still rests on "primes.in" being unavailable to attackers.                     *
+ *                                                                                         *
+ * "msg.in" and "msg.enc" are read and written through otpio.h, which uses io_uring where  *
+ * the kernel provides it. "DIRECT" has those files opened with O_DIRECT, bypassing the    *
+ * page cache, and "STDIO" forces the plain stdio fallback.                                *
+ *                                                                                         *
+ * If otptune.exe has written an "otp.tune" for this "primes.in", its choice of kernels,   *
+ * I/O request size and queue depth is used (see otptune.h). "STDIO" still wins over it.   *
+ *                                                                                         *
+ * A "msg.in" that needs only a few blocks of pad is encrypted by way of otpsmall.h, with  *
+ * no allocation per message - unless COMPRESS, APPEND, JOURNAL, DEBUG or DIRECT is given. *
+ * "msg.enc" comes out the same either way.                                                *
+ *                                                                                         *
+ * "BATCH" (which must come last) is followed by the names of any number of files, each of *
+ * which is encrypted - with a seed of its own - to a file of the same name plus ".enc".   *
+ * The files take consecutive values from next_seed.txt, their pads are generated side by  *
+ * side by the multi-buffer kernel in msmb.h, and they are all read and written in one     *
+ * otpio.h batch. Without "BATCH", "msg.in" is encrypted to "msg.enc" as a batch of one.   *
+ *                                                                                         *
+ * "APPEND" is for a "msg.in" that keeps growing, such as a log. The first APPEND run       *
+ * encrypts "msg.in" as usual (except that the count in the header of "msg.enc" is zero    *
+ * padded, so that it can later be rewritten in place) and saves the position of the pad   *
+ * in "msg.enc.state" (see otpstate.h). Each later APPEND run encrypts only the bytes that *
+ * have been added to "msg.in" since, onto the end of "msg.enc" - the result is the same   *
+ * as encrypting the whole of "msg.in" at once, and decrypt.exe reads it as one message.   *
+ * With COMPRESS, the new bytes become further otpz.h blocks. Delete "msg.enc.state" to    *
+ * start a new "msg.enc" (with a new seed).                                                *
+ *                                                                                         *
+ * "JOURNAL" is for a "msg.in" so large that its pad takes hours to generate. Every 60     *
+ * seconds (or every secs seconds, if a number follows) the part of "msg.enc" that's been  *
+ * determined is written, and the generator's progress is saved in "msg.enc.journal" (see  *
+ * otpjournal.h). If the run is stopped, running "encrypt.exe JOURNAL" again checks what   *
+ * was written and carries on from there, with the same seed and options as before. The    *
+ * count in the header of "msg.enc" is zero padded, as for APPEND. The journal is removed  *
+ * once "msg.enc" is complete. (In HYBRID mode there is nothing to journal.)               *
+ *                                                                                         *
  * USERID must be a unique value for each user. This value must consist of 11 decimal      *
  * digits. The leading (most siginificant) digit must be one, and the last (least          *
  * siginificant) 6 digits must all be "0".                                                 *
@@ -22,426 +70,634 @@
  * This value is incremented each time a message is encrypted, thus allowing for each user *
  * to send 1,000,000 encrypted messages - after which, new input primes need to be         *
  * generated - and next_seed.txt needs to be manually altered to contain "0".              *
+ * ("genprime.exe ROTATE" does both, for any number of users at once.)                     *
  *                                                                                         *
  *******************************************************************************************/
 
+#define _GNU_SOURCE /* for O_DIRECT in otpio.h */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <gmp.h>
+#include "otp.h"
+#include "otpz.h"
+#include "chacha20.h"
+#include "otpio.h"
+#include "msmb.h"
+#include "otpstate.h"
+#include "otpmsg.h"
+#include "otpjournal.h"
+#include "otptune.h"
+#include "otpsmall.h"
 
 #ifndef USERID
 #define USERID 1000000000 /* Edit this value (as per documented    *
                            * procedure) to be unique for all users */
 #endif
 
-int main(int argc, char *argv[]) {
- FILE* fp;
- int i_seed, base, i, i_count, i_bitsize;
- struct stat stbuf;
+#define STATE_FILE "msg.enc.state"
+#define JOURNAL_FILE "msg.enc.journal"
+
+/* One of the files being encrypted. */
+typedef struct {
+ const char *in_name, *out_name;
+ char *enc_buf;
+ size_t in_len, pad_shift;
+ otp_msg m;
+} enc_msg;
+
+/* Encrypt msg.in to msg.enc through otpsmall.h, if it's short enough. Returns -1, *
+ * having read msg.in at most, if it isn't - it then goes the usual way.           */
+static int small_msg(const otp_key *key, int hybrid) {
+ static otp_small s;
  struct stat stbuf_enc;
- struct stat p_stbuf;
- char seed_buf[11];
- char tmp[12];
- char *msg_buf, *tmp_buf, *chk_buf, *enc_buf, *prime_buf;
- mpz_t z_in, z_pad, z_mod, z_keep, z_check;
- size_t bitsize, r_shift, its, count, ret, pad_shift, bitdiff;
- mpz_t z_phi, pless1, qless1;
- mpz_t z_seed, p, q;
- unsigned int N, k, e, check, r;
- double kdoub;
- mpz_t z_enc;
-
- stat("msg.in", &stbuf);
-
- if(stbuf.st_size > 536870912) {
-   printf("This program cannot reliably deal with an 'msg.in' whose size is greater than 536,870,912 bytes.\n");
-   exit(1);
- }
+ otpio_file f;
+ size_t len;
+ int i_seed, flags = hybrid ? OTP_HYBRID : 0;
 
- stat("primes.in", &p_stbuf);
+ if(otpio_size("msg.in", &len, 536870912)) return 1;
+ if(otpio_direct || !otp_small_its(key, NULL, len, flags)) return -1;
 
- prime_buf = malloc(1 + p_stbuf.st_size);
+ memset(&f, 0, sizeof(f));
+ f.fname = "msg.in";
+ f.buf = (char*)s.in;
+ f.len = len;
+ if(otpio_transfer(&f, 1)) return 1;
 
- if(prime_buf == NULL) {
-   printf("Failed to allocate memory to prime_buf.\n");
-   exit(1);
+ if(!otp_small_its(key, s.in, len, flags)) return -1;
+
+ if(otp_next_seed("next_seed.txt", 1, USERID, &i_seed)) return 1;
+
+ printf("seed: %d\n", i_seed);
+ printf("sizeof 'msg.in': %d\n", (int)len);
+
+ if(hybrid && chacha20_selftest()) return 1;
+
+ otp_small_init(&s, key);
+ if(otp_small_enc(&s, key, i_seed, flags, len)) return 1;
+ otp_small_clear(&s);
+
+ printf("bitsize of message: %d\n", s.i_bitsize);
+
+ memset(&f, 0, sizeof(f));
+ f.fname = "msg.enc";
+ f.buf = (char*)s.out;
+ f.len = s.out_len;
+ f.write = 1;
+ if(otpio_transfer(&f, 1)) return 1;
+
+ if(stat("msg.enc", &stbuf_enc)) {
+   printf("Unable to stat msg.enc.\n");
+   return 1;
  }
 
-/**** START SETTING PRIMES ****/
+ printf("sizeof 'msg.enc': %d\n", (int)stbuf_enc.st_size);
 
- fp = fopen("primes.in", "r");
+ return 0;
+}
 
- if(fp == NULL) {
-   printf("Error while opening primes.in for reading.\n");
-   exit(1);
+/* Read msg->in_name a block at a time for COMPRESS, compressing each block (otpz.h) as it *
+ * comes, so that the whole file is never held uncompressed alongside its compressed form - *
+ * the buffer is otpz_bound() of the file, plus one block. If it doesn't shrink (and force  *
+ * isn't set) it's read again into that same buffer, to be encrypted as is.                 */
+static int read_compressed(enc_msg *msg, int force) {
+ unsigned char *block, *op;
+ char *z_buf;
+ size_t n, left;
+ FILE *fp;
+
+ z_buf = otpio_alloc(otpz_bound(msg->in_len));
+ block = (unsigned char*)malloc(OTPZ_BLOCK);
+
+ if(z_buf == NULL || block == NULL) {
+   printf("Failed to allocate memory to compression buffer.\n");
+   return 1;
  }
 
- fgets(prime_buf, p_stbuf.st_size, fp);
- base = atoi(prime_buf);
- if(base < 2 || base > 32) {
-   printf("value specified for base (%d) is outside of allowable range of 2 to 32.\n", base);
-   exit(1);
+ fp = fopen(msg->in_name, "rb");
+
+ if(fp == NULL) {
+   printf("Error while opening %s for reading.\n", msg->in_name);
+   return 1;
  }
 
- fgets(prime_buf, p_stbuf.st_size, fp);
- mpz_init_set_str(p, prime_buf, base);
+ op = (unsigned char*)z_buf;
+ *op++ = OTPZ_MAGIC;
 
- if(mpz_sizeinbase(p, 2) <= 500) {
-   printf("Bitsize of first prime(%d) needs to be geater than 500.\n", (int)mpz_sizeinbase(p, 2));
-   exit(1);
+ for(left = msg->in_len; left; left -= n) {
+   n = left < OTPZ_BLOCK ? left : OTPZ_BLOCK;
+   if(fread(block, 1, n, fp) != n) {
+     printf("Error while reading %s.\n", msg->in_name);
+     fclose(fp);
+     return 1;
+   }
+   op += otpz_compress_block(block, n, op);
  }
 
- fgets(prime_buf, p_stbuf.st_size, fp);
- mpz_init_set_str(q, prime_buf, base);
+ free(block);
 
- if(mpz_sizeinbase(q, 2) <= 500) {
-   printf("Bitsize of second prime(%d) needs to be geater than 500.\n", (int)mpz_sizeinbase(q, 2));
-   exit(1);
+ otp_msg_init(&msg->m, z_buf, op - (unsigned char*)z_buf);
+
+ if(msg->m.msg_len < msg->in_len || force) msg->m.flags |= OTP_COMPRESSED;
+ else {
+   rewind(fp);
+   if(fread(z_buf, 1, msg->in_len, fp) != msg->in_len) {
+     printf("Error while reading %s.\n", msg->in_name);
+     fclose(fp);
+     return 1;
+   }
+   msg->m.msg_len = msg->in_len;
  }
 
  fclose(fp);
- free(prime_buf);
 
- if(mpz_sizeinbase(p, 2) == mpz_sizeinbase(q, 2)) {
-   printf("Must select primes that differ in bitsize.\n");
-   exit(1);
+ return 0;
+}
+
+/* Encrypt whatever has been added to msg.in since the last APPEND run onto the end of *
+ * msg.enc, and bring the count in its header up to date. st is the saved state.      */
+static int append_msg(const otp_key *key, otp_state *st, int debug) {
+ FILE *fp = NULL, *in_fp = NULL;
+ char hdr[64];
+ char *new_buf = NULL, *z_buf = NULL, *body;
+ unsigned char hkey[OTP_HYBRID_BYTES];
+ size_t in_len, enc_len, new_len, blen, hlen;
+ int i_seed, i_count, i_diff, flags = 0, pos, n, ret = 1;
+ mpz_t z_seed, z_pad, z_new;
+ otp_msg hm;
+
+ if(st->N != key->N || st->e != key->e || st->fp != otp_key_fingerprint(key)) {
+   printf("%s was written for a different primes.in.\n", STATE_FILE);
+   return 1;
  }
 
- if(!mpz_probab_prime_p(p, 50)) {
-   printf("First prime is NOT prime.\n");
-   mpz_out_str(stdout, base, p);
-   printf("\n");
-   exit(1);
+ if(otpio_size("msg.in", &in_len, (size_t)-1)) return 1;
+
+ if(in_len < st->in_len) {
+   printf("msg.in (%llu bytes) is shorter than the %llu bytes already encrypted - it has been replaced.\n",
+          (unsigned long long)in_len, (unsigned long long)st->in_len);
+   printf("Delete %s to start a new msg.enc.\n", STATE_FILE);
+   return 1;
  }
 
- if(!mpz_probab_prime_p(q, 50)) {
-   printf("Second prime is NOT prime.\n");
-   mpz_out_str(stdout, base, q);
-   printf("\n");
-   exit(1);
+ new_len = in_len - st->in_len;
+ printf("seed: %d\n", st->i_seed);
+
+ if(new_len == 0) {
+   printf("Nothing has been added to msg.in since it was last encrypted.\n");
+   return 0;
  }
 
-/****  END SETTING OF PRIMES  ****/
-/** START PARSING NEXT_SEED.TXT **/
+ if(otpio_size("msg.enc", &enc_len, (size_t)-1)) return 1;
+
+ /* From here on, every way out goes through done. */
+ mpz_init(z_seed);
+ mpz_init(z_pad);
+ mpz_init(z_new);
+
+/** START PARSING MSG.ENC HEADER **/
 
- fp = fopen("next_seed.txt", "r");
+ fp = fopen("msg.enc", "r+b");
 
  if(fp == NULL) {
-   printf("Error while opening next_seed.txt for reading.\n");
-   exit(1);
+   printf("Error while opening msg.enc for appending.\n");
+   goto done;
  }
 
- if(fgets (seed_buf, 11, fp)==NULL) {
-   printf("Error while reading next_seed.txt.\n");
-   exit(1);
+ n = (int)fread(hdr, 1, sizeof(hdr) - 1, fp);
+ hdr[n] = 0;
+ pos = 0;
+
+ if(sscanf(hdr, "%d?%d#%d%n", &i_seed, &i_count, &i_diff, &pos) != 3) pos = 0;
+ if(pos && hdr[pos] == '!') {
+   n = 0;
+   if(sscanf(hdr + pos + 1, "%d%n", &flags, &n) != 1) pos = 0;
+   else pos += 1 + n;
  }
 
- i_seed = atoi(seed_buf);
+ if(!pos || hdr[pos] != '*' || i_seed != st->i_seed || flags != st->flags) {
+   printf("The header of msg.enc does not match %s.\n", STATE_FILE);
+   goto done;
+ }
 
- if(i_seed < 0 || i_seed > 999999) {
-   printf("Value read (%d) from next_seed.txt needs to be in range 0 to 999999 (inclusive).\n", i_seed);
-   exit(1);
+ hlen = pos + 1;
+
+ /* A run that stopped after saving the state, but before the header was updated, *
+  * leaves the header short - it's rewritten below along with the new count.      */
+ if(i_count < 0 || (size_t)i_count > st->count || enc_len < hlen + st->count) {
+   printf("msg.enc (%llu encrypted bytes) does not match %s (%llu encrypted bytes).\n",
+          (unsigned long long)i_count, STATE_FILE, (unsigned long long)st->count);
+   goto done;
  }
 
- i_seed += USERID;
+/** END PARSING MSG.ENC HEADER **/
 
- printf("seed: %d\n", i_seed);
+ new_buf = (char*)malloc(1 + new_len);
+ in_fp = fopen("msg.in", "rb");
 
- fclose(fp);
+ if(new_buf == NULL || in_fp == NULL) {
+   printf("Unable to read the new bytes of msg.in.\n");
+   goto done;
+ }
 
- if(i_seed < 1000000000 || i_seed >= 2000000000) {
-   printf("The seed (%d) should now be in the range 1,000,000,000 to 1,999,999,999 (inclusive).\n", i_seed);
-   exit(1);
+ if(fseek(in_fp, (long)st->in_len, SEEK_SET) || fread(new_buf, 1, new_len, in_fp) != new_len) {
+   printf("Unable to read the %llu new bytes of msg.in.\n", (unsigned long long)new_len);
+   goto done;
  }
 
- fp = fopen("next_seed.txt", "w");
+ fclose(in_fp);
+ in_fp = NULL;
 
- if(fp == NULL) {
-   printf("Error while opening next_seed.txt for writing.\n");
-   exit(1);
- }
+ printf("new bytes in 'msg.in': %d\n", (int)new_len);
 
- sprintf(seed_buf, "%d", i_seed - USERID + 1);
- fputs(seed_buf, fp);
- fclose(fp);
+ body = new_buf;
+ blen = new_len;
 
-/** END PARSING NEXT_SEED.TXT **/
+ /* A compressed msg.enc is a run of independent otpz.h blocks after the magic *
+  * byte, so the new bytes are simply further blocks (without another magic).  */
+ if(flags & OTP_COMPRESSED) {
+   z_buf = (char*)malloc(1 + otpz_bound(new_len));
+   if(z_buf == NULL) {
+     printf("Failed to allocate memory to compression buffer.\n");
+     goto done;
+   }
 
- fp = fopen("msg.in", "rb");
+   blen = otpz_compress((unsigned char*)new_buf, new_len, (unsigned char*)z_buf) - 1;
+   body = z_buf + 1;
+   printf("compressed size of new bytes: %d\n", (int)blen);
+ }
 
- if(fp == NULL) {
-   printf("Error while opening msg.in for reading.\n");
-   exit(1);
+ if(st->count + blen > 536870912) {
+   printf("msg.enc would grow beyond 536870912 encrypted bytes. Delete %s to start a new msg.enc.\n", STATE_FILE);
+   goto done;
  }
 
- msg_buf = malloc(1 + stbuf.st_size);
- if(msg_buf == NULL) {
-   printf("Failed to allocate memory to message string.\n");
-   exit(1);
+ if(flags & OTP_HYBRID) {
+   if(chacha20_selftest() || otp_seed(key, st->i_seed, z_seed) || otp_pad(key, z_seed, 8 * OTP_HYBRID_BYTES, z_pad))
+     goto done;
+
+   otp_export(hkey, OTP_HYBRID_BYTES, z_pad);
+   chacha20_xor(hkey, hkey + 32, st->count, (unsigned char*)body, blen);
+   memset(hkey, 0, sizeof(hkey));
  }
+ else {
+   if(otp_state_pad(key, st, 8 * blen, z_pad)) goto done;
 
- tmp_buf = malloc(1 + stbuf.st_size);
- if(tmp_buf == NULL) {
-   printf("Failed to allocate memory to temporary storage string.\n");
-   exit(1);
+   if(debug) {
+     printf("PAD:\n");
+     mpz_out_str(stdout, 16, z_pad);
+     printf("\n");
+   }
+
+   mpz_import(z_new, blen, 1, 1, 0, 0, body);
+   mpz_xor(z_new, z_new, z_pad);
+   otp_export((unsigned char*)body, blen, z_new);
  }
 
- chk_buf = malloc(1 + stbuf.st_size);
- if(chk_buf == NULL) {
-   printf("Failed to allocate memory to check string.\n");
-   exit(1);
+ /* The encrypted bytes go down first, then the state, then the header - so that *
+  * an interrupted run can always be picked up again by the next one.            */
+ n = fseek(fp, (long)(hlen + st->count), SEEK_SET) == 0 && fwrite(body, 1, blen, fp) == blen && fflush(fp) == 0;
+#ifdef OTPSTATE_POSIX
+ if(n) n = fsync(fileno(fp)) == 0;
+#endif
+
+ if(!n) {
+   printf("Failed to append to msg.enc.\n");
+   goto done;
  }
 
- printf("sizeof 'msg.in': %d\n", (int)stbuf.st_size);
+ st->count += blen;
+ st->in_len = in_len;
 
- msg_buf[0] = 0;
- tmp[11] = 0;
+ if(otp_state_save(STATE_FILE, st)) goto done;
 
- ret = fread(msg_buf, 1, stbuf.st_size, fp);
+ memset(&hm, 0, sizeof(hm));
+ hm.i_seed = st->i_seed;
+ hm.i_count = (int)st->count;
+ hm.i_bitsize = hm.i_count * 8 - i_diff;
+ hm.flags = flags;
 
- if(ret != stbuf.st_size) {
-   printf("'msg.in' contains %d bytes but %d were read to msg_buf.\n", (int)stbuf.st_size, (int)ret);
-   exit(1);
+ if(otp_msg_header(hdr, &hm, 1) != hlen || fseek(fp, 0, SEEK_SET) || fwrite(hdr, 1, hlen, fp) != hlen) {
+   printf("Failed to update the header of msg.enc.\n");
+   goto done;
  }
 
- msg_buf[stbuf.st_size] = 0;
+ n = fclose(fp);
+ fp = NULL;
 
- fclose(fp);
+ if(n) {
+   printf("Error while closing msg.enc.\n");
+   goto done;
+ }
 
- mpz_init(z_in);
- mpz_import(z_in, stbuf.st_size, 1, 1, 0, 0, msg_buf);
+ printf("sizeof 'msg.enc': %d\n", (int)(hlen + st->count));
+ ret = 0;
 
- if(argc > 1 && !strcmp(argv[1], "DEBUG")) {
-   printf("MESSAGE:\n");
-   mpz_out_str(stdout, 16, z_in);
-   printf("\n");
+ done:
+ if(fp != NULL) fclose(fp);
+ if(in_fp != NULL) fclose(in_fp);
+ free(new_buf);
+ free(z_buf);
+ mpz_clear(z_seed);
+ mpz_clear(z_pad);
+ mpz_clear(z_new);
+ return ret;
+}
+
+int main(int argc, char *argv[]) {
+ int i_seed, i, nmsg = 1;
+ int debug = 0, compress = 0, hybrid = 0, append = 0, journal = 0, resume = 0, secs = OTP_JOURNAL_SECS;
+ struct stat stbuf_enc;
+ char *z_buf;
+ size_t m;
+ mpz_t z_seed;
+ otp_key key;
+ enc_msg *msgs, *msg;
+ otp_gen **gens;
+ otpio_file *files;
+ msmb_ctx *mb;
+ char **names = NULL;
+ otp_state st;
+ otp_journal jn;
+
+ for(i = 1; i < argc; i++) {
+   if(!strcmp(argv[i], "DEBUG")) debug = 1;
+   else if(!strcmp(argv[i], "COMPRESS")) compress = 1;
+   else if(!strcmp(argv[i], "HYBRID")) hybrid = 1;
+   else if(!strcmp(argv[i], "DIRECT")) otpio_direct = 1;
+   else if(!strcmp(argv[i], "STDIO")) otpio_mode = OTPIO_STDIO;
+   else if(!strcmp(argv[i], "APPEND") && !journal) append = 1;
+   else if(!strcmp(argv[i], "JOURNAL") && !append) {
+     journal = 1;
+     if(i + 1 < argc && argv[i + 1][0] >= '0' && argv[i + 1][0] <= '9') secs = atoi(argv[++i]);
+   }
+   else if(!strcmp(argv[i], "BATCH") && i + 1 < argc && !append && !journal) {
+     names = argv + i + 1;
+     nmsg = argc - i - 1;
+     break;
+   }
+   else {
+     printf("Usage: encrypt.exe [DEBUG] [COMPRESS] [HYBRID] [DIRECT] [STDIO] [APPEND | JOURNAL [secs] | BATCH file ...]\n");
+     exit(1);
+   }
  }
 
- bitsize = mpz_sizeinbase(z_in, 2);
- i_bitsize = (int)bitsize;
+ if(hybrid) journal = 0; /* its pad is a single step */
 
- printf("bitsize of message: %d\n", i_bitsize);
+/**** START SETTING PRIMES ****/
 
- mpz_export(chk_buf, &count, 1, 1, 0, 0, z_in);
- chk_buf[count] = 0;
+ if(otp_load_key("primes.in", &key)) exit(1);
+ otp_tune_use(&key, debug);
 
- /* i_count = (int)count; */ /* No !! We need to set i_count to the 'count' from the next mpz_export */
+/****  END SETTING OF PRIMES  ****/
 
- if(strcmp(msg_buf, chk_buf)) {
-   printf("<%s>\nIS NOT\n<%s>\n", msg_buf, chk_buf);
-   exit(1);
+ /* Once there's an APPEND state, msg.in is encrypted on from where it left off. */
+ if(append) {
+   otp_state_init(&st);
+   i = otp_state_load(STATE_FILE, &st);
+   if(i > 0) exit(1);
+
+   if(!i) {
+     i = append_msg(&key, &st, debug);
+     otp_state_clear(&st);
+     mpz_clear(key.z_phi);
+     return i;
+   }
+
+   /* the key is cleared before the new state is saved */
+   st.N = key.N;
+   st.e = key.e;
+   st.fp = otp_key_fingerprint(&key);
  }
 
- for(i = 0; i < count; i++ ) {
-   if(msg_buf[i] != chk_buf[i]) {
-     printf("byte[%d] differs between msg_buf and chk_buf.\n", i);
-     exit(1);
+ /* A short message on its own needs none of the machinery below. */
+ if(names == NULL && !append && !journal && !compress && !debug) {
+   i = small_msg(&key, hybrid);
+   if(i >= 0) {
+     mpz_clear(key.z_phi);
+     return i;
    }
- }
 
- if(msg_buf[count] != chk_buf[count]) {
-   printf("msg_buf[%d] != chk_buf[%d]\n", (int)count, (int)count);
-   exit(1);
+   /* the key is cleared before the new state is saved */
+   st.N = key.N;
+   st.e = key.e;
+   st.fp = otp_key_fingerprint(&key);
  }
 
- if(msg_buf[count] != 0) {
-   printf("msg_buf[%d] and chk_buf[%d] are not NULL>\n", (int)count, (int)count);
+ msgs = calloc(nmsg, sizeof(enc_msg));
+ gens = malloc(nmsg * sizeof(otp_gen*));
+ files = calloc(nmsg, sizeof(otpio_file));
+ mb = malloc(sizeof(msmb_ctx));
+ if(msgs == NULL || gens == NULL || files == NULL || mb == NULL) {
+   printf("Failed to allocate memory for %d messages.\n", nmsg);
    exit(1);
  }
 
-/**** START SEED GEN ****/
+ for(m = 0; m < nmsg; m++) {
+   msg = msgs + m;
+   if(names == NULL) {
+     msg->in_name = "msg.in";
+     msg->out_name = "msg.enc";
+   }
+   else {
+     msg->in_name = names[m];
+     z_buf = malloc(strlen(names[m]) + 5);
+     if(z_buf == NULL) {
+       printf("Failed to allocate memory to output file name.\n");
+       exit(1);
+     }
+     sprintf(z_buf, "%s.enc", names[m]);
+     msg->out_name = z_buf;
+   }
 
- mpz_init_set_si(z_seed, i_seed);
+   if(otpio_size(msg->in_name, &msg->in_len, 536870912)) exit(1);
+ }
 
- if(mpz_cmp_si(z_seed, 0) < 0) {
-   printf("Negative seed in seed gen.\n");
-   exit(1);
+ if(append && msgs[0].in_len == 0) {
+   printf("msg.in is empty - there is nothing to encrypt yet.\n");
+   return 0;
  }
 
- mpz_init(z_phi);
- mpz_init(pless1);
- mpz_init(qless1);
+/** START PARSING NEXT_SEED.TXT **/
 
- mpz_sub_ui(qless1, q, 1);
- mpz_sub_ui(pless1, p, 1);
+ /* A journalled run that was stopped is resumed with the seed and options it had. */
+ if(journal) {
+   otp_journal_init(&jn, JOURNAL_FILE, "msg.enc", 1, secs);
+   i = otp_journal_load(&jn);
+   if(i > 0) exit(1);
+   resume = !i;
+ }
 
- mpz_mul(z_phi, p, q);
+ if(resume) {
+   i_seed = jn.i_seed;
+   compress = jn.flags & OTP_COMPRESSED;
+ }
+ else if(otp_next_seed("next_seed.txt", nmsg, USERID, &i_seed)) exit(1);
 
- N = mpz_sizeinbase(z_phi, 2);
- e = N / 80;
- if(!(e & 1)) --e; /* gcd(phi,e) must be 1 - which implies that e must be odd */
+ printf("seed: %d\n", i_seed);
 
- mpz_mul(z_phi, pless1, qless1);
- mpz_clear(pless1);
- mpz_clear(qless1);
+/** END PARSING NEXT_SEED.TXT **/
 
- while(1) {
-   if(mpz_gcd_ui(NULL, z_phi, e) == 1) break;
-   e -= 2;
-   if(e < 3) {
-     printf("The chosen primes are unsuitable in seed gen function. Select other primes P ad Q\n");
-     exit(1);
-   }
- }
+ /* An APPEND stream stays compressed, since later blocks may well shrink. */
+ for(m = 0; m < nmsg; m++) {
+   msg = msgs + m;
 
- kdoub = (double) 2 / (double)e;
- kdoub = (double) 1 - kdoub;
- kdoub *= (double) N;
- k = (int)kdoub;
- r = N - k;
+   if(compress) {
+     if(read_compressed(msg, append || resume)) exit(1);
+   }
+   else {
+     z_buf = otpio_alloc(msg->in_len);
+     if(z_buf == NULL) {
+       printf("Failed to allocate memory to read %s.\n", msg->in_name);
+       exit(1);
+     }
+
+     otp_msg_init(&msg->m, z_buf, msg->in_len);
+
+     files[m].fname = msg->in_name;
+     files[m].buf = z_buf;
+     files[m].len = msg->in_len;
+   }
 
- /* Given seed (i_seed) needs to be expanded  *
-  * to r bits. Pad with '0111' sequences.     */
- while(mpz_sizeinbase(z_seed, 2) < r) {
-   mpz_mul_2exp(z_seed, z_seed, 1);
-   if(mpz_sizeinbase(z_seed, 2) & 3)
-     mpz_add_ui(z_seed, z_seed, 1);
+   msg->m.i_seed = i_seed + (int)m;
+   msg->m.debug = debug;
+   if(hybrid) msg->m.flags |= OTP_HYBRID;
  }
 
- if(mpz_sizeinbase(z_seed, 2) != r) {
-   printf("The size of the seed (%d) being used should be %d.\n", (int)mpz_sizeinbase(z_seed, 2), r);
-   exit(1);
- }
+ if(!compress && otpio_transfer(files, nmsg)) exit(1);
 
-/****  END SEED GEN  ****/
-/****  START PAD GEN ****/
+ mpz_init(z_seed);
 
- r_shift = bitsize % k;
+ for(m = 0; m < nmsg; m++) {
+   msg = msgs + m;
+   msg->m.msg_buf[msg->m.msg_len] = 0;
 
- if(r_shift) its = (bitsize / k) + 1;
- else its = bitsize / k;
+   if(names != NULL) printf("%s (seed %d):\n", msg->in_name, msg->m.i_seed);
+   printf("sizeof '%s': %d\n", msg->in_name, (int)msg->in_len);
 
- if(its < 1) {
-   printf("At least one iteration must be done.\n");
-   exit(1);
- }
+   if(compress) {
+     if(msg->m.flags & OTP_COMPRESSED)
+       printf("compressed size of '%s': %d\n", msg->in_name, (int)msg->m.msg_len);
+     else
+       printf("'%s' does not compress - it will be encrypted uncompressed.\n", msg->in_name);
+   }
 
-  if(argc > 1 && !strcmp(argv[1], "DEBUG")) {
-   printf("HEX SEED:\n");
-   mpz_out_str(stdout, 16, z_seed);
-   printf("\n");
- }
+/**** START SEED GEN ****/
 
- mpz_init(z_mod);
- mpz_init(z_keep);
- mpz_init_set_ui(z_pad, 0);
- mpz_ui_pow_ui(z_mod, 2, k);
+   if(otp_seed(&key, msg->m.i_seed, z_seed)) exit(1);
 
- for(i = 0; i < its; ++i) {
-   mpz_powm_ui(z_seed, z_seed, e, z_phi);
-   mpz_mod(z_keep, z_seed, z_mod);
-   mpz_mul_2exp(z_pad, z_pad, k);
-   mpz_add(z_pad, z_pad, z_keep);
-   mpz_fdiv_q_2exp(z_seed, z_seed, k);
- }
+   if(debug) {
+     printf("HEX SEED:\n");
+     mpz_out_str(stdout, 16, z_seed);
+     printf("\n");
+   }
 
- mpz_clear(z_phi);
- mpz_clear(z_keep);
- mpz_clear(z_mod);
+/****  END SEED GEN  ****/
 
- if(r_shift) mpz_fdiv_q_2exp(z_pad, z_pad, k - r_shift);
+   if(otp_enc_begin(&key, &msg->m, z_seed)) exit(1);
 
- /***************************************************************
-  * enc_buf is the encrypted message. It is written to msg.enc. *
-  * That buffer is prefixed with the information needed for the *
-  * recipient to decrypt the message. Hence we provide it with  *
-  * an additional 28 bytes (though 25 should be sufficient).    *
-  ***************************************************************/
- enc_buf = malloc(28 + stbuf.st_size);
+   printf("bitsize of message: %d\n", msg->m.i_bitsize);
 
- if(argc > 1 && !strcmp(argv[1], "DEBUG")) {
-   printf("PAD:\n");
-   mpz_out_str(stdout, 16, z_pad);
-   printf("\n");
- }
+   if(journal && otp_journal_start(&key, &jn, &msg->m)) exit(1);
 
-/****  END PAD GEN   ****/
+   gens[m] = &msg->m.gen;
+ }
 
- mpz_init(z_enc);
- mpz_xor(z_enc, z_in, z_pad);
- bitdiff = mpz_sizeinbase(z_in, 2) - mpz_sizeinbase(z_enc, 2);
+ mpz_clear(z_seed);
 
- if(argc > 1 && !strcmp(argv[1], "DEBUG")) {
-   printf("bitsize of input message: %d\n", mpz_sizeinbase(z_in, 2));
-   printf("bitsize of pad: %d\n", mpz_sizeinbase(z_pad, 2));
-   printf("bitsize of encrypted message: %d\n", mpz_sizeinbase(z_enc, 2));
-   printf("MSG:\n");
-   mpz_out_str(stdout, 16, z_enc);
-   printf("\n");
- }
+/****  START PAD GEN ****/
 
- mpz_export(chk_buf, &count, 1, 1, 0, 0, z_enc);
- chk_buf[count] = 0;
+ /* A lone message gains nothing from the kernel, so don't bother checking it. */
+ if(nmsg >= msmb_min_lanes) msmb_init(mb, &key);
+ else mb->use = 0;
 
- i_count = count;
+ if(journal) otp_journal_run(&key, &jn, &msgs[0].m);
+ else msmb_run(mb, &key, gens, nmsg);
 
- mpz_init(z_check);
- mpz_import(z_check, count, 1, 1, 0, 0, chk_buf);
+ if(debug) printf("MicaliSchnorr kernel: %s\n", mb->use ? msmb_kernel_name : "gmp");
 
- if(mpz_cmp(z_check, z_enc)) {
-   printf("mpz_export-mpz_import round trip failed.\n");
-   printf("strlen(chk_buf): %d\n", (int)strlen(chk_buf));
-   exit(1);
- }
+/****  END PAD GEN   ****/
 
- sprintf(enc_buf, "%d", i_seed);
+ mpz_clear(key.z_phi);
 
- strcat(enc_buf, "?");
- sprintf(tmp, "%d", i_count);
- strcat(enc_buf, tmp);
+ if(hybrid && chacha20_selftest()) exit(1);
 
- strcat(enc_buf, "#");
- sprintf(tmp, "%d", (i_count * 8) - i_bitsize);
- strcat(enc_buf, tmp);
+ for(m = 0; m < nmsg; m++) {
+   msg = msgs + m;
 
- strcat(enc_buf, "*");
+   if(otp_enc_end(&key, &msg->m, append ? st.z_rest : NULL)) exit(1);
 
- pad_shift = strlen(enc_buf);
- enc_buf += pad_shift;
- for(i = 0; i < count; i++)
-   enc_buf[i] = chk_buf[i];
- enc_buf[count] = 0;
- enc_buf -= pad_shift;
+   if(append) {
+     st.rest_bits = msg->m.gen.its * key.k - msg->m.gen.bitsize;
+     mpz_set(st.z_seed, msg->m.gen.z_seed);
+   }
 
- if(strlen(enc_buf) != pad_shift + strlen(chk_buf)) {
-   printf("string being written to msg.enc might be incorrect.\n");
-   exit(1);
- }
+   /***************************************************************
+    * enc_buf is the encrypted message. It is written to msg.enc. *
+    * That buffer is prefixed with the information needed for the *
+    * recipient to decrypt the message. Hence we provide it with  *
+    * an additional 48 bytes (though 27 should be sufficient).    *
+    ***************************************************************/
+   msg->enc_buf = otpio_alloc(48 + msg->m.out_len);
 
- fp = fopen("msg.enc", "wb");
+   if(msg->enc_buf == NULL) {
+     printf("Failed to allocate memory to enc_buf.\n");
+     exit(1);
+   }
 
- if(fp == NULL) {
-   printf("Error while opening msg.enc for writing.\n");
-   exit(1);
- }
+   msg->pad_shift = otp_msg_header(msg->enc_buf, &msg->m, append || journal);
+   memcpy(msg->enc_buf + msg->pad_shift, msg->m.out_buf, msg->m.out_len);
+   msg->enc_buf[msg->pad_shift + msg->m.out_len] = 0;
 
- if(argc > 1 && !strcmp(argv[1], "DEBUG")) {
-   printf("ENCRYPTED MESSAGE:\n");
-   for(i = 0; i < count + pad_shift; i++)
-     printf("%02x", ((const unsigned char*)enc_buf)[i]);
-   printf("\n");
- }
+   if(memcmp(msg->enc_buf + msg->pad_shift, msg->m.out_buf, msg->m.out_len)) {
+     printf("string being written to %s might be incorrect.\n", msg->out_name);
+     exit(1);
+   }
 
- ret = fwrite(enc_buf, 1, count + pad_shift, fp);
+   if(debug) {
+     printf("ENCRYPTED MESSAGE:\n");
+     for(i = 0; i < msg->m.out_len + msg->pad_shift; i++)
+       printf("%02x", ((const unsigned char*)msg->enc_buf)[i]);
+     printf("\n");
+   }
 
- if(ret < count + pad_shift) {
-   printf("ret: %d < %d\n", (int)ret, (int)count + (int)pad_shift);
-   exit(1);
+   memset(&files[m], 0, sizeof(otpio_file));
+   files[m].fname = msg->out_name;
+   files[m].buf = msg->enc_buf;
+   files[m].len = msg->m.out_len + msg->pad_shift;
+   files[m].write = 1;
  }
 
- if(argc > 1 && !strcmp(argv[1], "DEBUG")) {
-   printf("%d bytes written to enc_buf\n", (int)count + (int)pad_shift);
+ if(journal) {
+   if(otp_journal_end(&jn, msgs[0].enc_buf, files[0].len)) exit(1);
+   otp_journal_clear(&jn);
  }
+ else if(otpio_transfer(files, nmsg)) exit(1);
 
- fclose(fp);
+ if(append) {
+   st.i_seed = msgs[0].m.i_seed;
+   st.flags = msgs[0].m.flags;
+   st.count = msgs[0].m.out_len;
+   st.in_len = msgs[0].in_len;
+   if(otp_state_save(STATE_FILE, &st)) exit(1);
+   otp_state_clear(&st);
+ }
 
- stat("msg.enc", &stbuf_enc);
- printf("sizeof 'msg.enc': %d\n", (int)stbuf_enc.st_size);
+ for(m = 0; m < nmsg; m++) {
+   msg = msgs + m;
 
- return 0;
-}
+   if(debug) {
+     printf("%d bytes written to enc_buf (%s)\n", (int)files[m].len, otpio_used);
+   }
 
+   if(stat(msg->out_name, &stbuf_enc)) {
+     printf("Unable to stat %s.\n", msg->out_name);
+     exit(1);
+   }
 
+   printf("sizeof '%s': %d\n", msg->out_name, (int)stbuf_enc.st_size);
+ }
 
+ return 0;
+}
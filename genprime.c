@@ -2,8 +2,9 @@
  * Copyright 2020 sisyphus                                                                 *
  * The gmp library (https://gmplib.org) is required.                                       *
  *                                                                                         *
- * I build genprime.exe with: gcc -o genprime.exe genprime.c -lgmp                         *
+ * I build genprime.exe with: gcc -o genprime.exe genprime.c -lgmp -pthread                *
  * Usage: genprime.exe base integer_string1 integer_string2                                *
+ *    or: genprime.exe ROTATE users [threads] [OVERWRITE]                                  *
  *                                                                                         *
  * Arguments:                                                                              *
  *  base: a number between 2 and 32 (inclusive) that specifies the numeric base, b, of the *
@@ -29,13 +30,268 @@
  * The same base and primes must be used by both encrypt.exe and decrypt.exe. The          *
  * security depends upon the values of the two primes being available only to the sender   *
  * and the intended recipient(s) of the encrypted message.                                 *
+ *                                                                                         *
+ * "ROTATE" makes new keys for users 0 to users - 1 (at most 1000 - see USERID in          *
+ * encrypt.c) all in one run, for when their seeds have been used up. For each user a      *
+ * ROTATE_BITS1 bit and a ROTATE_BITS2 bit prime are searched for from starting points     *
+ * read from /dev/urandom, and the pair must pass the same checks that encrypt.exe and     *
+ * decrypt.exe make of "primes.in" (otp_key_set() in otp.h) - or another pair is found.    *
+ * The users are shared out between threads (one per CPU by default). User n's key goes    *
+ * to "keyring/nnn/primes.in" (base 32, readable only by its owner), and then a            *
+ * "keyring/nnn/next_seed.txt" of "0" is written beside it. Each file is replaced          *
+ * atomically, and in that order, so an interrupted rotation never pairs an old key with a *
+ * reset seed.                                                                             *
+ *                                                                                         *
+ * A user who already has a "keyring/nnn/primes.in" keeps it - it may have encrypted       *
+ * messages that are still to be decrypted - unless "OVERWRITE" is given. (If only its     *
+ * "next_seed.txt" is missing, that key was never used, and the seed file is written.) So  *
+ * running the same ROTATE again finishes one that was interrupted, or that failed for     *
+ * some users, without touching the keys that were made.                                   *
  *******************************************************************************************/
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <gmp.h>
+#include "otp.h"
+
+#define ROTATE_BITS1 600  /* bitsizes of the two primes of each rotated key */
+#define ROTATE_BITS2 620
+#define ROTATE_BASE 32
+#define ROTATE_DIR "keyring"
+#define ROTATE_TRIES 10   /* pairs tried for a user before giving up */
+#define ROTATE_MAX_THREADS 256
+
+/* A rotation in progress - shared by its threads. */
+typedef struct {
+ pthread_mutex_t lock;
+ FILE *urandom;
+ int users, next, failed, kept, overwrite;
+} rotation;
+
+/* Set p to the smallest prime greater than a, checked with 2 + iterations / bits *
+ * Miller-Rabin tests. a is used up.                                               */
+static void find_prime(mpz_t p, mpz_t a, int iterations) {
+ size_t bitsize = mpz_sizeinbase(a, 2);
+
+ while(1) {
+   mpz_nextprime(p, a);
+   if(mpz_probab_prime_p(p, 2 + (iterations / bitsize))) break;
+   mpz_add_ui(a, p, 1);
+ }
+}
+
+/* Set z to a random bits bit number (its top bit set) from /dev/urandom. */
+static int random_start(rotation *rt, mpz_t z, size_t bits) {
+ unsigned char buf[(ROTATE_BITS2 + 7) / 8];
+ size_t len = (bits + 7) / 8, got;
+
+ pthread_mutex_lock(&rt->lock);
+ got = fread(buf, 1, len, rt->urandom);
+ pthread_mutex_unlock(&rt->lock);
+
+ if(got != len) {
+   printf("Failed to read /dev/urandom.\n");
+   return 1;
+ }
+
+ mpz_import(z, len, 1, 1, 0, 0, buf);
+ memset(buf, 0, len);
+ mpz_fdiv_r_2exp(z, z, bits);
+ mpz_setbit(z, bits - 1);
+
+ return 0;
+}
+
+/* Replace fname with text, by way of fname.tmp, so that it's never left half written. */
+static int write_file(const char *fname, const char *text, mode_t mode) {
+ char tmp[64];
+ FILE *fp;
+ int fd, bad;
+
+ sprintf(tmp, "%s.tmp", fname);
+
+ fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, mode);
+ if(fd < 0 || (fp = fdopen(fd, "w")) == NULL) {
+   printf("Couldn't create %s for writing: %s\n", tmp, strerror(errno));
+   if(fd >= 0) close(fd);
+   return 1;
+ }
+
+ bad = fputs(text, fp) < 0 || fflush(fp) || fsync(fd);
+ if(fclose(fp) || bad || rename(tmp, fname)) {
+   printf("Error while writing %s: %s\n", fname, strerror(errno));
+   remove(tmp);
+   return 1;
+ }
+
+ return 0;
+}
+
+/* Make and write the key of user u - unless u has a key already and rt->overwrite isn't set. */
+static int rotate_user(rotation *rt, int u) {
+ char dir[32], fname[64], *text, *sp, *sq;
+ struct stat st;
+ mpz_t a, p, q;
+ otp_key key;
+ int i, ret = 1;
+
+ sprintf(dir, "%s/%03d", ROTATE_DIR, u);
+ sprintf(fname, "%s/primes.in", dir);
+
+ if(!rt->overwrite && !stat(fname, &st)) {
+   sprintf(fname, "%s/next_seed.txt", dir);
+   if(stat(fname, &st)) {
+     if(write_file(fname, "0\n", 0600)) return 1;
+     printf("%s/primes.in: kept, and %s written\n", dir, fname);
+   }
+   else printf("%s/primes.in: kept (OVERWRITE replaces it)\n", dir);
+
+   pthread_mutex_lock(&rt->lock);
+   rt->kept++;
+   pthread_mutex_unlock(&rt->lock);
+   return 0;
+ }
+
+ mpz_init(a);
+ mpz_init(p);
+ mpz_init(q);
+
+ for(i = 0; i < ROTATE_TRIES; i++) {
+   if(random_start(rt, a, ROTATE_BITS1)) goto done;
+   find_prime(p, a, 50000);
+   if(random_start(rt, a, ROTATE_BITS2)) goto done;
+   find_prime(q, a, 50000);
+
+   if(!otp_key_set(&key, p, q, ROTATE_BASE)) break;
+   printf("User %03d: trying another pair of primes.\n", u);
+ }
+
+ if(i == ROTATE_TRIES) {
+   printf("User %03d: no usable pair of primes in %d tries.\n", u, ROTATE_TRIES);
+   goto done;
+ }
+
+ if(mkdir(dir, 0700) && errno != EEXIST) {
+   printf("Couldn't create %s: %s\n", dir, strerror(errno));
+   goto wipe;
+ }
+
+ sp = mpz_get_str(NULL, ROTATE_BASE, p);
+ sq = mpz_get_str(NULL, ROTATE_BASE, q);
+ text = (char*)malloc(strlen(sp) + strlen(sq) + 8);
+ if(text == NULL) {
+   printf("Failed to allocate memory for %s/primes.in.\n", dir);
+ }
+ else {
+   sprintf(text, "%d\n%s\n%s\n", ROTATE_BASE, sp, sq);
+
+   sprintf(fname, "%s/primes.in", dir);
+   if(!write_file(fname, text, 0600)) {
+     sprintf(fname, "%s/next_seed.txt", dir);
+     if(!write_file(fname, "0\n", 0600)) ret = 0;
+   }
+
+   memset(text, 0, strlen(text));
+   free(text);
+ }
+
+ memset(sp, 0, strlen(sp));
+ memset(sq, 0, strlen(sq));
+ free(sp);
+ free(sq);
+
+ if(!ret) printf("%s/primes.in: %u bit key, e = %u\n", dir, key.N, key.e);
+
+ wipe:
+ mpz_clear(key.z_phi);
+
+ done:
+ mpz_clear(a);
+ mpz_clear(p);
+ mpz_clear(q);
+ return ret;
+}
+
+static void *rotate_worker(void *arg) {
+ rotation *rt = (rotation *)arg;
+ int u;
+
+ while(1) {
+   pthread_mutex_lock(&rt->lock);
+   u = rt->next++;
+   pthread_mutex_unlock(&rt->lock);
+
+   if(u >= rt->users) break;
+
+   if(rotate_user(rt, u)) {
+     pthread_mutex_lock(&rt->lock);
+     rt->failed++;
+     pthread_mutex_unlock(&rt->lock);
+   }
+ }
+
+ return NULL;
+}
+
+static int rotate(int users, int threads, int overwrite) {
+ pthread_t th[ROTATE_MAX_THREADS];
+ rotation rt;
+ int i;
+
+ if(users < 1 || users > 1000) {
+   printf("The number of users (%d) needs to be in the range 1 to 1000 (inclusive).\n", users);
+   return 1;
+ }
+
+ if(threads < 1) threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+ if(threads < 1) threads = 1;
+ if(threads > ROTATE_MAX_THREADS) threads = ROTATE_MAX_THREADS;
+ if(threads > users) threads = users;
+
+ if(mkdir(ROTATE_DIR, 0700) && errno != EEXIST) {
+   printf("Couldn't create %s: %s\n", ROTATE_DIR, strerror(errno));
+   return 1;
+ }
+
+ memset(&rt, 0, sizeof(rt));
+ rt.users = users;
+ rt.overwrite = overwrite;
+ pthread_mutex_init(&rt.lock, NULL);
+
+ rt.urandom = fopen("/dev/urandom", "rb");
+ if(rt.urandom == NULL) {
+   printf("Couldn't open /dev/urandom.\n");
+   return 1;
+ }
+ setvbuf(rt.urandom, NULL, _IONBF, 0);
+
+ for(i = 0; i < threads; i++) {
+   if(pthread_create(&th[i], NULL, rotate_worker, &rt)) {
+     printf("Failed to start thread %d.\n", i + 1);
+     exit(1);
+   }
+ }
+ for(i = 0; i < threads; i++)
+   pthread_join(th[i], NULL);
+
+ fclose(rt.urandom);
+ pthread_mutex_destroy(&rt.lock);
+
+ if(rt.failed) {
+   printf("%d of %d keys were NOT rotated - run genprime.exe ROTATE again.\n", rt.failed, users);
+   return 1;
+ }
+
+ printf("Successfully Done - %d new keys, %d kept, in %s/ (%d thread%s)\n", users - rt.kept, rt.kept, ROTATE_DIR,
+        threads, threads > 1 ? "s" : "");
+ return 0;
+}
 
 int main(int argc, char *argv[]) {
  FILE *fp;
@@ -47,8 +303,24 @@ int main(int argc, char *argv[]) {
                           * tests that are conducted to verify that the prime is prime *
                           * (beyond reasonable doubt).                                 */
 
+ if(argc >= 3 && argc <= 5 && !strcmp(argv[1], "ROTATE")) {
+   int threads = 0, overwrite = 0, i;
+
+   for(i = 3; i < argc; i++) {
+     if(!strcmp(argv[i], "OVERWRITE")) overwrite = 1;
+     else if(argv[i][0] >= '1' && argv[i][0] <= '9') threads = atoi(argv[i]);
+     else {
+       printf("Usage: genprime.exe ROTATE users [threads] [OVERWRITE]\n");
+       return 1;
+     }
+   }
+
+   return rotate(atoi(argv[2]), threads, overwrite);
+ }
+
  if(argc != 4) {
    printf("Usage: genprime base integer_string1 integer_string2\n");
+   printf("   or: genprime ROTATE users [threads]\n");
    exit(1);
  }
 
@@ -0,0 +1,425 @@
+/*******************************************************************************************
+ * Copyright 2020 sisyphus                                                                 *
+ *                                                                                         *
+ * msmb.h - multi-buffer MicaliSchnorr. When several messages are being encrypted (or      *
+ * decrypted) at once, each has its own seed and so its own chain of                       *
+ * mpz_powm_ui(z_seed, z_seed, e, z_phi) calls - but all of those chains share z_phi and   *
+ * e. The kernel here advances MSMB_LANES of them at once, one chain per 64 bit lane of    *
+ * the AVX-512 registers, using the 52 bit multiply-accumulate instructions of AVX512-IFMA.*
+ *                                                                                         *
+ * z_phi = (p - 1)(q - 1) is even, so Montgomery multiplication is out - each lane instead *
+ * reduces with Barrett's method (HAC Algorithm 14.42) in radix 2^52. Seeds are only r     *
+ * bits long, so the early squarings of each exponentiation are done on short operands    *
+ * and need no reduction at all.                                                           *
+ *                                                                                         *
+ * msmb_run() is the scheduler: it hands each free lane to the next generator that still   *
+ * has blocks to produce, so the lanes stay full for as long as there's enough work. When  *
+ * fewer than msmb_min_lanes generators remain, or the CPU lacks AVX512-IFMA, it falls     *
+ * back to one mpz_powm_ui() per generator. (AVX2 and plain AVX-512F offer only 32x32 bit  *
+ * lane multipliers, which need ~2.5 times the partial products of the 52 bit limbs here - *
+ * at these sizes they don't beat GMP's scalar code, so there are no such kernels.)        *
+ *******************************************************************************************/
+
+#ifndef MSMB_H
+#define MSMB_H
+
+#include <stdint.h>
+#include <string.h>
+#include <gmp.h>
+#include "otp.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define MSMB_X86 1
+#include <immintrin.h>
+#endif
+
+#define MSMB_LANES     8
+#define MSMB_MIN_LANES 4      /* with fewer active generators than this, GMP is as quick */
+#define MSMB_BITS      52
+#define MSMB_MASK      ((UINT64_C(1) << MSMB_BITS) - 1)
+#define MSMB_MAXN      80     /* limbs - i.e. moduli of up to 4160 bits */
+
+typedef struct {
+ int use;                               /* the kernel is usable for this key */
+ int n;                                 /* 52 bit limbs in z_phi            */
+ unsigned int mbits, xbits, e;
+ uint64_t m[MSMB_MAXN + 1];
+ uint64_t mu[MSMB_MAXN + 2];            /* floor(2^(104n) / z_phi)           */
+} msmb_ctx;
+
+static int msmb_disable = 0;            /* set to keep to the scalar path */
+static int msmb_min_lanes = MSMB_MIN_LANES; /* measured for the host by otptune.exe, if it's been run */
+static const char *msmb_kernel_name = "gmp";
+
+/* Split the low 52 * n bits of z into n 52 bit limbs, writing limb i to out[i * stride]. */
+static inline void msmb_split(const mpz_t z, uint64_t *out, int n, int stride) {
+ const mp_limb_t *p = mpz_limbs_read(z);
+ size_t size = mpz_size(z), w;
+ unsigned int sh;
+ uint64_t v;
+ int i;
+
+ for(i = 0; i < n; i++) {
+   w = (size_t)i * MSMB_BITS / 64;
+   sh = (unsigned int)((size_t)i * MSMB_BITS % 64);
+   v = w < size ? (uint64_t)p[w] >> sh : 0;
+   if(sh > 64 - MSMB_BITS && w + 1 < size) v |= (uint64_t)p[w + 1] << (64 - sh);
+   out[(size_t)i * stride] = v & MSMB_MASK;
+ }
+}
+
+/* The inverse of msmb_split(). */
+static inline void msmb_join(mpz_t z, const uint64_t *in, int n, int stride) {
+ size_t size = ((size_t)n * MSMB_BITS + 63) / 64, w;
+ mp_limb_t *p = mpz_limbs_write(z, size);
+ unsigned int sh;
+ uint64_t v;
+ int i;
+
+ memset(p, 0, size * sizeof(mp_limb_t));
+
+ for(i = 0; i < n; i++) {
+   v = in[(size_t)i * stride];
+   w = (size_t)i * MSMB_BITS / 64;
+   sh = (unsigned int)((size_t)i * MSMB_BITS % 64);
+   p[w] |= (mp_limb_t)(v << sh);
+   if(sh > 64 - MSMB_BITS) p[w + 1] |= (mp_limb_t)(v >> (64 - sh));
+ }
+
+ mpz_limbs_finish(z, size);
+}
+
+#ifdef MSMB_X86
+
+#define MSMB_TARGET __attribute__((target("avx512f,avx512ifma")))
+
+/* r[0 .. na+nb) = a[0 .. na) * b[0 .. nb), normalised to 52 bit limbs. r must not overlap a or b. */
+MSMB_TARGET
+static inline void msmb_mul(__m512i *r, const __m512i *a, int na, const __m512i *b, int nb) {
+ __m512i hi[2 * MSMB_MAXN + 4], t, c, mask = _mm512_set1_epi64(MSMB_MASK);
+ int i, j;
+
+ for(i = 0; i < na + nb; i++) {
+   r[i] = _mm512_setzero_si512();
+   hi[i] = _mm512_setzero_si512();
+ }
+
+ for(i = 0; i < na; i++) {
+   for(j = 0; j < nb; j++) {
+     r[i + j] = _mm512_madd52lo_epu64(r[i + j], a[i], b[j]);
+     hi[i + j + 1] = _mm512_madd52hi_epu64(hi[i + j + 1], a[i], b[j]);
+   }
+ }
+
+ c = _mm512_setzero_si512();
+ for(i = 0; i < na + nb; i++) {
+   t = _mm512_add_epi64(_mm512_add_epi64(r[i], hi[i]), c);
+   r[i] = _mm512_and_si512(t, mask);
+   c = _mm512_srli_epi64(t, MSMB_BITS);
+ }
+}
+
+/* r[0 .. 2na) = a[0 .. na)^2 - each cross product is formed once and doubled. */
+MSMB_TARGET
+static inline void msmb_sqr(__m512i *r, const __m512i *a, int na) {
+ __m512i hi[2 * MSMB_MAXN + 4], t, c, mask = _mm512_set1_epi64(MSMB_MASK);
+ int i, j;
+
+ for(i = 0; i < 2 * na; i++) {
+   r[i] = _mm512_setzero_si512();
+   hi[i] = _mm512_setzero_si512();
+ }
+
+ for(i = 0; i < na; i++) {
+   for(j = i + 1; j < na; j++) {
+     r[i + j] = _mm512_madd52lo_epu64(r[i + j], a[i], a[j]);
+     hi[i + j + 1] = _mm512_madd52hi_epu64(hi[i + j + 1], a[i], a[j]);
+   }
+ }
+
+ for(i = 0; i < 2 * na; i++) {
+   r[i] = _mm512_slli_epi64(r[i], 1);
+   hi[i] = _mm512_slli_epi64(hi[i], 1);
+ }
+
+ for(i = 0; i < na; i++) {
+   r[2 * i] = _mm512_madd52lo_epu64(r[2 * i], a[i], a[i]);
+   hi[2 * i + 1] = _mm512_madd52hi_epu64(hi[2 * i + 1], a[i], a[i]);
+ }
+
+ c = _mm512_setzero_si512();
+ for(i = 0; i < 2 * na; i++) {
+   t = _mm512_add_epi64(_mm512_add_epi64(r[i], hi[i]), c);
+   r[i] = _mm512_and_si512(t, mask);
+   c = _mm512_srli_epi64(t, MSMB_BITS);
+ }
+}
+
+/* r = r - m if that doesn't go negative, for r of n + 1 limbs. */
+MSMB_TARGET
+static inline void msmb_condsub(const msmb_ctx *ctx, __m512i *r) {
+ __m512i t[MSMB_MAXN + 2], b = _mm512_setzero_si512(), mask = _mm512_set1_epi64(MSMB_MASK), d;
+ __mmask8 keep;
+ int i;
+
+ for(i = 0; i <= ctx->n; i++) {
+   d = _mm512_sub_epi64(_mm512_sub_epi64(r[i], _mm512_set1_epi64(i < ctx->n ? ctx->m[i] : 0)), b);
+   b = _mm512_srli_epi64(d, 63);
+   t[i] = _mm512_and_si512(d, mask);
+ }
+
+ keep = _mm512_cmpeq_epi64_mask(b, _mm512_setzero_si512()); /* no borrow: r >= m */
+ for(i = 0; i <= ctx->n; i++)
+   r[i] = _mm512_mask_mov_epi64(r[i], keep, t[i]);
+}
+
+/* r[0 .. n) = x mod z_phi, for x of 2n limbs (x < 2^(104n)). */
+MSMB_TARGET
+static inline void msmb_reduce(const msmb_ctx *ctx, __m512i *r, const __m512i *x) {
+ __m512i mu[MSMB_MAXN + 2], m[MSMB_MAXN + 1], q2[2 * MSMB_MAXN + 4], q3[MSMB_MAXN + 2];
+ __m512i qh[MSMB_MAXN + 4], lo[MSMB_MAXN + 2], hi[MSMB_MAXN + 2], t, c, b, mask = _mm512_set1_epi64(MSMB_MASK);
+ int n = ctx->n, i, j;
+
+ for(i = 0; i <= n; i++)
+   mu[i] = _mm512_set1_epi64(ctx->mu[i]);
+ for(i = 0; i < n; i++)
+   m[i] = _mm512_set1_epi64(ctx->m[i]);
+
+ /* q3 = ((x >> 52(n-1)) * mu) >> 52(n+1). Columns below n - 1 of the product can carry *
+  * less than 1 into column n + 1, so they're skipped (HAC 14.44) at the cost of q3 being  *
+  * up to 1 short - hence the third conditional subtraction below.                        */
+ for(i = n - 1; i <= 2 * n + 2; i++) {
+   q2[i] = _mm512_setzero_si512();
+   qh[i - n + 1] = _mm512_setzero_si512();
+ }
+ for(i = 0; i <= n; i++) {
+   for(j = i < n - 1 ? n - 1 - i : 0; j <= n; j++) {
+     q2[i + j] = _mm512_madd52lo_epu64(q2[i + j], x[n - 1 + i], mu[j]);
+     qh[i + j + 2 - n] = _mm512_madd52hi_epu64(qh[i + j + 2 - n], x[n - 1 + i], mu[j]);
+   }
+ }
+ c = _mm512_setzero_si512();
+ for(i = n - 1; i <= 2 * n + 1; i++) {
+   t = _mm512_add_epi64(_mm512_add_epi64(q2[i], qh[i - n + 1]), c);
+   if(i > n) q3[i - n - 1] = _mm512_and_si512(t, mask);
+   c = _mm512_srli_epi64(t, MSMB_BITS);
+ }
+
+ /* lo = (q3 * m) mod 2^(52(n+1)) */
+ for(i = 0; i <= n + 1; i++) {
+   lo[i] = _mm512_setzero_si512();
+   hi[i] = _mm512_setzero_si512();
+ }
+ for(i = 0; i <= n; i++) {
+   for(j = 0; j < n && i + j <= n; j++) {
+     lo[i + j] = _mm512_madd52lo_epu64(lo[i + j], q3[i], m[j]);
+     if(i + j < n) hi[i + j + 1] = _mm512_madd52hi_epu64(hi[i + j + 1], q3[i], m[j]);
+   }
+ }
+
+ /* r = (x - q3 * m) mod 2^(52(n+1)), normalising the product as we go */
+ c = _mm512_setzero_si512();
+ b = _mm512_setzero_si512();
+ for(i = 0; i <= n; i++) {
+   t = _mm512_add_epi64(_mm512_add_epi64(lo[i], hi[i]), c);
+   c = _mm512_srli_epi64(t, MSMB_BITS);
+   t = _mm512_sub_epi64(_mm512_sub_epi64(x[i], _mm512_and_si512(t, mask)), b);
+   b = _mm512_srli_epi64(t, 63);
+   r[i] = _mm512_and_si512(t, mask);
+ }
+
+ /* now r < 4 * z_phi */
+ msmb_condsub(ctx, r);
+ msmb_condsub(ctx, r);
+ msmb_condsub(ctx, r);
+}
+
+/* y = x^e mod z_phi in every lane, for x of ctx->xbits bits at most. */
+MSMB_TARGET
+static inline void msmb_powm_avx512ifma(const msmb_ctx *ctx, uint64_t *y, const uint64_t *x) {
+ __m512i xv[MSMB_MAXN + 1], cur[2 * MSMB_MAXN + 4], t[2 * MSMB_MAXN + 4];
+ int nx = (ctx->xbits + MSMB_BITS - 1) / MSMB_BITS, nc, i, bit;
+ unsigned int cb;
+
+ for(i = 0; i < nx; i++)
+   xv[i] = _mm512_load_si512((const void*)(x + MSMB_LANES * i));
+
+ memcpy(cur, xv, nx * sizeof(__m512i));
+ nc = nx;
+ cb = ctx->xbits;
+
+ for(bit = 30; !(ctx->e >> bit & 1); bit--);
+
+ /* Left to right square and multiply. A product that's known to be under 2^(mbits-1) *
+  * is already below z_phi and is left unreduced (and kept to its short length).      */
+ for(bit--; bit >= 0; bit--) {
+   msmb_sqr(t, cur, nc);
+   cb *= 2;
+   if(cb < ctx->mbits - 1) {
+     nc = (cb + MSMB_BITS - 1) / MSMB_BITS;
+     memcpy(cur, t, nc * sizeof(__m512i));
+   }
+   else {
+     for(i = 2 * nc; i < 2 * ctx->n; i++)
+       t[i] = _mm512_setzero_si512();
+     msmb_reduce(ctx, cur, t);
+     nc = ctx->n;
+     cb = ctx->mbits;
+   }
+
+   if(ctx->e >> bit & 1) {
+     msmb_mul(t, cur, nc, xv, nx);
+     cb += ctx->xbits;
+     if(cb < ctx->mbits - 1) {
+       nc = (cb + MSMB_BITS - 1) / MSMB_BITS;
+       memcpy(cur, t, nc * sizeof(__m512i));
+     }
+     else {
+       for(i = nc + nx; i < 2 * ctx->n; i++)
+         t[i] = _mm512_setzero_si512();
+       msmb_reduce(ctx, cur, t);
+       nc = ctx->n;
+       cb = ctx->mbits;
+     }
+   }
+ }
+
+ for(i = 0; i < ctx->n; i++)
+   _mm512_store_si512((void*)(y + MSMB_LANES * i), i < nc ? cur[i] : _mm512_setzero_si512());
+}
+
+#endif
+
+/* z[i] = z[i]^e mod z_phi for i < n (n <= MSMB_LANES), each z[i] of at most xbits bits. */
+static inline void msmb_powm(const msmb_ctx *ctx, mpz_t *z[], int n) {
+#ifdef MSMB_X86
+ uint64_t x[MSMB_MAXN * MSMB_LANES] __attribute__((aligned(64)));
+ uint64_t y[MSMB_MAXN * MSMB_LANES] __attribute__((aligned(64)));
+ int i;
+
+ memset(x, 0, sizeof(uint64_t) * MSMB_LANES * ctx->n);
+ for(i = 0; i < n; i++)
+   msmb_split(*z[i], x + i, (ctx->xbits + MSMB_BITS - 1) / MSMB_BITS, MSMB_LANES);
+
+ msmb_powm_avx512ifma(ctx, y, x);
+
+ for(i = 0; i < n; i++)
+   msmb_join(*z[i], y + i, ctx->n, MSMB_LANES);
+#endif
+}
+
+/* Set up ctx for key, checking the kernel against mpz_powm_ui(). If the CPU can't *
+ * run it, or the key is too big for it, ctx->use is left at 0.                    */
+static inline void msmb_init(msmb_ctx *ctx, const otp_key *key) {
+ mpz_t z, want, in[MSMB_LANES], got[MSMB_LANES], *zp[MSMB_LANES];
+ gmp_randstate_t rs;
+ int i, j;
+
+ memset(ctx, 0, sizeof(*ctx));
+ msmb_kernel_name = "gmp";
+
+#ifdef MSMB_X86
+ __builtin_cpu_init();
+ if(msmb_disable || !__builtin_cpu_supports("avx512f") || !__builtin_cpu_supports("avx512ifma")) return;
+
+ ctx->mbits = (unsigned int)mpz_sizeinbase(key->z_phi, 2);
+ ctx->xbits = key->r;
+ ctx->e = key->e;
+ ctx->n = (ctx->mbits + MSMB_BITS - 1) / MSMB_BITS;
+ if(ctx->n > MSMB_MAXN || ctx->xbits >= ctx->mbits) return;
+
+ mpz_init(z);
+ msmb_split(key->z_phi, ctx->m, ctx->n, 1);
+ mpz_setbit(z, 2 * MSMB_BITS * ctx->n);
+ mpz_fdiv_q(z, z, key->z_phi);
+ if(mpz_sizeinbase(z, 2) > (size_t)MSMB_BITS * (ctx->n + 1)) {
+   mpz_clear(z);
+   return;
+ }
+ msmb_split(z, ctx->mu, ctx->n + 1, 1);
+
+ /* Known answers come from mpz_powm_ui() - including the largest possible seed. *
+  * Every lane is checked in every round, as each has its own place in the kernel. */
+ mpz_init(want);
+ gmp_randinit_default(rs);
+ gmp_randseed_ui(rs, key->N);
+ for(i = 0; i < MSMB_LANES; i++) {
+   mpz_init(in[i]);
+   mpz_init(got[i]);
+   zp[i] = &got[i];
+ }
+
+ for(j = 0; j < 4; j++) {
+   for(i = 0; i < MSMB_LANES; i++) {
+     if(i == j) {
+       mpz_set_ui(in[i], 0);
+       mpz_setbit(in[i], ctx->xbits);
+       mpz_sub_ui(in[i], in[i], 1);
+     }
+     else mpz_urandomb(in[i], rs, ctx->xbits);
+     mpz_set(got[i], in[i]);
+   }
+
+   msmb_powm(ctx, zp, MSMB_LANES);
+
+   for(i = 0; i < MSMB_LANES; i++) {
+     mpz_powm_ui(want, in[i], ctx->e, key->z_phi);
+     if(mpz_cmp(want, got[i])) {
+       printf("The multi-buffer kernel gave a wrong answer (lane %d) - using mpz_powm_ui() instead.\n", i);
+       goto done;
+     }
+   }
+ }
+
+ ctx->use = 1;
+ msmb_kernel_name = "avx512ifma";
+
+ done:
+ for(i = 0; i < MSMB_LANES; i++) {
+   mpz_clear(in[i]);
+   mpz_clear(got[i]);
+ }
+ gmp_randclear(rs);
+ mpz_clear(want);
+ mpz_clear(z);
+#endif
+}
+
+/* Run the n generators at g to completion. Free lanes are refilled from the *
+ * generators still waiting, in order, so that the kernel runs full.         */
+static inline void msmb_run(const msmb_ctx *ctx, const otp_key *key, otp_gen **g, size_t n) {
+ otp_gen *lane[MSMB_LANES];
+ mpz_t *zp[MSMB_LANES];
+ size_t next = 0;
+ int active = 0, i;
+
+ while(1) {
+   /* admit waiting generators into free lanes */
+   while(active < MSMB_LANES && next < n) {
+     if(g[next]->done < g[next]->its) lane[active++] = g[next];
+     next++;
+   }
+
+   if(!active) break;
+
+   if(ctx->use && active >= msmb_min_lanes) {
+     for(i = 0; i < active; i++)
+       zp[i] = &lane[i]->z_seed;
+     msmb_powm(ctx, zp, active);
+     for(i = 0; i < active; i++)
+       otp_gen_put(key, lane[i], lane[i]->z_seed);
+   }
+   else {
+     for(i = 0; i < active; i++)
+       otp_gen_step(key, lane[i]);
+   }
+
+   /* retire finished generators, keeping the lanes packed */
+   for(i = 0; i < active; ) {
+     if(lane[i]->done == lane[i]->its) lane[i] = lane[--active];
+     else i++;
+   }
+ }
+}
+
+#endif
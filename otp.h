@@ -0,0 +1,361 @@
+/*******************************************************************************************
+ * Copyright 2020 sisyphus                                                                 *
+ *                                                                                         *
+ * otp.h - the parts of the MicaliSchnorr generator that encrypt.c and decrypt.c share:    *
+ * reading and checking "primes.in", deriving N, e, k and r from the primes, expanding a   *
+ * seed to r bits and generating the pad.                                                  *
+ *                                                                                         *
+ * Each function prints a message describing any problem and returns non-zero, leaving it  *
+ * to the caller to decide whether to exit.                                                *
+ *******************************************************************************************/
+
+#ifndef OTP_H
+#define OTP_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <gmp.h>
+
+/* Flags that may appear (as "!flags") in the header of msg.enc. */
+#define OTP_COMPRESSED 1 /* message was compressed (otpz.h) before encryption     */
+#define OTP_HYBRID     2 /* message was XOR'd with ChaCha20 (chacha20.h) keystream */
+#define OTP_FLAGS      (OTP_COMPRESSED | OTP_HYBRID)
+
+/* In hybrid mode this many bytes of MicaliSchnorr pad become the ChaCha20 key and nonce. */
+#define OTP_HYBRID_BYTES 44
+
+/* Keys whose r fits in this many limbs have their seed padding precomputed (see otp_seed()). */
+#define OTP_SEED_LIMBS 8
+
+typedef struct {
+ mpz_t z_phi;  /* (p - 1) * (q - 1) */
+ unsigned int N, k, e, r;
+ mp_limb_t seed_tmpl[OTP_SEED_LIMBS]; /* the '0111' padding of an r bit seed */
+} otp_key;
+
+/* Check the primes p and q (printed in base if they aren't prime) and fill in key from *
+ * them. These are the checks that every "primes.in" must pass - genprime.c makes its   *
+ * keyrings with them too.                                                               */
+static inline int otp_key_set(otp_key *key, const mpz_t p, const mpz_t q, int base) {
+ mpz_t pless1, qless1;
+ double kdoub;
+ unsigned int i;
+
+ if(mpz_sizeinbase(p, 2) <= 500) {
+   printf("Bitsize of first prime(%d) needs to be geater than 500.\n", (int)mpz_sizeinbase(p, 2));
+   return 1;
+ }
+
+ if(mpz_sizeinbase(q, 2) <= 500) {
+   printf("Bitsize of second prime(%d) needs to be geater than 500.\n", (int)mpz_sizeinbase(q, 2));
+   return 1;
+ }
+
+ if(mpz_sizeinbase(p, 2) == mpz_sizeinbase(q, 2)) {
+   printf("Must select primes that differ in bitsize.\n");
+   return 1;
+ }
+
+ if(!mpz_probab_prime_p(p, 50)) {
+   printf("First prime is NOT prime.\n");
+   mpz_out_str(stdout, base, p);
+   printf("\n");
+   return 1;
+ }
+
+ if(!mpz_probab_prime_p(q, 50)) {
+   printf("Second prime is NOT prime.\n");
+   mpz_out_str(stdout, base, q);
+   printf("\n");
+   return 1;
+ }
+
+ mpz_init(key->z_phi);
+ mpz_init(pless1);
+ mpz_init(qless1);
+
+ mpz_sub_ui(qless1, q, 1);
+ mpz_sub_ui(pless1, p, 1);
+
+ mpz_mul(key->z_phi, p, q);
+
+ key->N = mpz_sizeinbase(key->z_phi, 2);
+ key->e = key->N / 80;
+ if(!(key->e & 1)) --key->e; /* gcd(phi,e) must be 1 - which implies that e must be odd */
+
+ mpz_mul(key->z_phi, pless1, qless1);
+ mpz_clear(pless1);
+ mpz_clear(qless1);
+
+ if(key->e < 3) {
+   printf("You need to choose different primes P and Q. The product of P and Q needs to be at least a 240-bit number");
+   mpz_clear(key->z_phi);
+   return 1;
+ }
+
+ while(1) {
+   if(mpz_gcd_ui(NULL, key->z_phi, key->e) == 1) break;
+   key->e -= 2;
+   if(key->e < 3) {
+     printf("The chosen primes are unsuitable in seed gen function. Select other primes P ad Q\n");
+     mpz_clear(key->z_phi);
+     return 1;
+   }
+ }
+
+ kdoub = (double) 2 / (double)key->e;
+ kdoub = (double) 1 - kdoub;
+ kdoub *= (double) key->N;
+ key->k = (int)kdoub;
+ key->r = key->N - key->k;
+
+ /* Bit r - L of a seed that has been padded out to L bits is 1 unless L is a multiple of 4. */
+ memset(key->seed_tmpl, 0, sizeof(key->seed_tmpl));
+ if(key->r <= OTP_SEED_LIMBS * GMP_NUMB_BITS) {
+   for(i = 2; i <= key->r; i++)
+     if(i & 3) key->seed_tmpl[(key->r - i) / GMP_NUMB_BITS] |= (mp_limb_t)1 << ((key->r - i) % GMP_NUMB_BITS);
+ }
+
+ return 0;
+}
+
+/* FNV-1a of the key - phi, N and e - for telling one "primes.in" from another (otpcache.h, *
+ * otptune.h, otpstate.h and otpjournal.h), since keys of one size often share N and e.   */
+static inline unsigned long long otp_key_fingerprint(const otp_key *key) {
+ const mp_limb_t *l = mpz_limbs_read(key->z_phi);
+ size_t i, n = mpz_size(key->z_phi);
+ unsigned long long h = 14695981039346656037ULL;
+ unsigned char b;
+ int j;
+
+ for(i = 0; i < n; i++) {
+   for(j = 0; j < (int)sizeof(mp_limb_t); j++) {
+     b = (unsigned char)(l[i] >> (8 * j));
+     h ^= b;
+     h *= 1099511628211ULL;
+   }
+ }
+
+ h ^= key->N;
+ h *= 1099511628211ULL;
+ h ^= key->e;
+ h *= 1099511628211ULL;
+
+ return h;
+}
+
+/* Read the primes from fname, check them, and fill in key. */
+static inline int otp_load_key(const char *fname, otp_key *key) {
+ FILE *fp;
+ struct stat p_stbuf;
+ char *prime_buf;
+ mpz_t p, q;
+ int base, ret;
+
+ if(stat(fname, &p_stbuf)) {
+   printf("Unable to stat %s.\n", fname);
+   return 1;
+ }
+
+ prime_buf = (char*)malloc(1 + p_stbuf.st_size);
+
+ if(prime_buf == NULL) {
+   printf("Failed to allocate memory to prime_buf.\n");
+   return 1;
+ }
+
+ fp = fopen(fname, "r");
+
+ if(fp == NULL) {
+   printf("Error while opening %s for reading.\n", fname);
+   free(prime_buf);
+   return 1;
+ }
+
+ fgets(prime_buf, p_stbuf.st_size, fp);
+ base = atoi(prime_buf);
+ if(base < 2 || base > 32) {
+   printf("value specified for base (%d) is outside of allowable range of 2 to 32.\n", base);
+   fclose(fp);
+   free(prime_buf);
+   return 1;
+ }
+
+ fgets(prime_buf, p_stbuf.st_size, fp);
+ mpz_init_set_str(p, prime_buf, base);
+
+ fgets(prime_buf, p_stbuf.st_size, fp);
+ mpz_init_set_str(q, prime_buf, base);
+
+ fclose(fp);
+ free(prime_buf);
+
+ ret = otp_key_set(key, p, q, base);
+
+ mpz_clear(p);
+ mpz_clear(q);
+ return ret;
+}
+
+/* Set z_seed (already initialised) to i_seed expanded to r bits. The padding that the loop *
+ * below appends depends only on how many bits i_seed has, so for most keys it's taken      *
+ * from key->seed_tmpl instead: the seed is i_seed shifted up to the top of r bits, OR'd    *
+ * with the bits of the template below it.                                                 */
+static inline int otp_seed(const otp_key *key, int i_seed, mpz_t z_seed) {
+ size_t b, sh, n, i;
+ mp_limb_t *s;
+
+ mpz_set_si(z_seed, i_seed);
+
+ if(mpz_cmp_si(z_seed, 0) < 0) {
+   printf("Negative seed in seed gen.\n");
+   return 1;
+ }
+
+ b = mpz_sizeinbase(z_seed, 2);
+
+ if(i_seed > 0 && b <= key->r && key->r <= OTP_SEED_LIMBS * GMP_NUMB_BITS) {
+   sh = key->r - b;
+   n = (key->r + GMP_NUMB_BITS - 1) / GMP_NUMB_BITS;
+   s = mpz_limbs_write(z_seed, n);
+
+   for(i = 0; i < n; i++) {
+     if(i < sh / GMP_NUMB_BITS) s[i] = key->seed_tmpl[i];
+     else if(i == sh / GMP_NUMB_BITS) s[i] = key->seed_tmpl[i] & (((mp_limb_t)1 << (sh % GMP_NUMB_BITS)) - 1);
+     else s[i] = 0;
+   }
+
+   s[sh / GMP_NUMB_BITS] |= (mp_limb_t)i_seed << (sh % GMP_NUMB_BITS);
+   if(sh % GMP_NUMB_BITS && sh / GMP_NUMB_BITS + 1 < n)
+     s[sh / GMP_NUMB_BITS + 1] |= (mp_limb_t)i_seed >> (GMP_NUMB_BITS - sh % GMP_NUMB_BITS);
+
+   mpz_limbs_finish(z_seed, n);
+ }
+ else {
+   /* Given seed (i_seed) needs to be expanded  *
+    * to r bits. Pad with '0111' sequences.     */
+   while(mpz_sizeinbase(z_seed, 2) < key->r) {
+     mpz_mul_2exp(z_seed, z_seed, 1);
+     if(mpz_sizeinbase(z_seed, 2) & 3)
+       mpz_add_ui(z_seed, z_seed, 1);
+   }
+ }
+
+ if(mpz_sizeinbase(z_seed, 2) != key->r) {
+   printf("The size of the seed (%d) being used should be %d.\n", (int)mpz_sizeinbase(z_seed, 2), key->r);
+   return 1;
+ }
+
+ return 0;
+}
+
+/* The state of one run of the generator: the seed, and the pad being built from it. The pad *
+ * is allocated at its full size up front and each k bit block is OR'd into place, so that   *
+ * a long pad costs no more than the sum of its blocks.                                      */
+typedef struct {
+ mpz_t z_seed, z_pad;
+ size_t bitsize, its, done, nlimbs;
+ mp_limb_t *pad;
+} otp_gen;
+
+/* Start a run of the generator from z_seed that will produce bitsize bits. */
+static inline int otp_gen_init(const otp_key *key, otp_gen *g, const mpz_t z_seed, size_t bitsize) {
+ g->bitsize = bitsize;
+ g->its = bitsize / key->k;
+ if(bitsize % key->k) g->its++;
+ g->done = 0;
+
+ if(g->its < 1) {
+   printf("At least one iteration must be done.\n");
+   return 1;
+ }
+
+ mpz_init_set(g->z_seed, z_seed);
+ mpz_init(g->z_pad);
+ g->nlimbs = (g->its * key->k + GMP_NUMB_BITS - 1) / GMP_NUMB_BITS;
+ g->pad = mpz_limbs_write(g->z_pad, g->nlimbs);
+ memset(g->pad, 0, g->nlimbs * sizeof(mp_limb_t));
+
+ return 0;
+}
+
+/* OR the low k bits of z_x into pad (nlimbs long, zeroed to start with) at bit pos. */
+static inline void otp_pad_put(const otp_key *key, mp_limb_t *pad, size_t nlimbs, size_t pos, const mpz_t z_x) {
+ const mp_limb_t *x = mpz_limbs_read(z_x);
+ size_t xn = mpz_size(z_x), kn = (key->k + GMP_NUMB_BITS - 1) / GMP_NUMB_BITS, i, w;
+ unsigned int sh = pos % GMP_NUMB_BITS;
+ mp_limb_t v;
+
+ for(i = 0; i < kn && i < xn; i++) {
+   v = x[i];
+   if(i == kn - 1 && key->k % GMP_NUMB_BITS) v &= ((mp_limb_t)1 << (key->k % GMP_NUMB_BITS)) - 1;
+   w = pos / GMP_NUMB_BITS + i;
+   pad[w] |= v << sh;
+   if(sh && w + 1 < nlimbs) pad[w + 1] |= v >> (GMP_NUMB_BITS - sh);
+ }
+}
+
+/* Take z_x (= z_seed^e mod phi) as the next step of the run: its low k bits  *
+ * go into the pad, and the rest become the seed. z_x may be g->z_seed itself. */
+static inline void otp_gen_put(const otp_key *key, otp_gen *g, mpz_t z_x) {
+ otp_pad_put(key, g->pad, g->nlimbs, (size_t)key->k * (g->its - 1 - g->done), z_x);
+ mpz_fdiv_q_2exp(g->z_seed, z_x, key->k);
+ g->done++;
+}
+
+/* One step of the run, done with GMP. */
+static inline void otp_gen_step(const otp_key *key, otp_gen *g) {
+ mpz_powm_ui(g->z_seed, g->z_seed, key->e, key->z_phi);
+ otp_gen_put(key, g, g->z_seed);
+}
+
+/* Once all its steps are done, trim g->z_pad to the bitsize that was asked for. If z_rest *
+ * isn't NULL it's set to the bits of the last block that were generated but not used -   *
+ * the first its * k - bitsize bits that the generator would produce next.               */
+static inline void otp_gen_finish(const otp_key *key, otp_gen *g, mpz_t z_rest) {
+ size_t r_shift = g->bitsize % key->k;
+
+ mpz_limbs_finish(g->z_pad, g->nlimbs);
+
+ if(z_rest != NULL) {
+   if(r_shift) mpz_fdiv_r_2exp(z_rest, g->z_pad, key->k - r_shift);
+   else mpz_set_ui(z_rest, 0);
+ }
+
+ if(r_shift) mpz_fdiv_q_2exp(g->z_pad, g->z_pad, key->k - r_shift);
+}
+
+static inline void otp_gen_clear(otp_gen *g) {
+ mpz_clear(g->z_seed);
+ mpz_clear(g->z_pad);
+}
+
+/* Run the generator on from z_seed, setting z_pad (already initialised) to the *
+ * first bitsize bits that it produces. z_seed is advanced as a side effect.    */
+static inline int otp_pad(const otp_key *key, mpz_t z_seed, size_t bitsize, mpz_t z_pad) {
+ otp_gen g;
+
+ if(otp_gen_init(key, &g, z_seed, bitsize)) return 1;
+
+ while(g.done < g.its)
+   otp_gen_step(key, &g);
+
+ otp_gen_finish(key, &g, NULL);
+ mpz_swap(z_pad, g.z_pad);
+ mpz_swap(z_seed, g.z_seed);
+ otp_gen_clear(&g);
+
+ return 0;
+}
+
+/* Write z to exactly len big-endian bytes at buf, zero filling on the left. */
+static inline void otp_export(unsigned char *buf, size_t len, const mpz_t z) {
+ size_t count = (mpz_sizeinbase(z, 2) + 7) / 8;
+
+ memset(buf, 0, len);
+ if(mpz_sgn(z) && count <= len) mpz_export(buf + len - count, NULL, 1, 1, 0, 0, z);
+}
+
+#endif
@@ -0,0 +1,263 @@
+/*******************************************************************************************
+ * Copyright 2020 sisyphus                                                                 *
+ * The gmp library (https://gmplib.org) is required.                                       *
+ *                                                                                         *
+ * I build otpasync.exe with: g++ -std=c++20 -o otpasync.exe otpasync.cpp -lgmp -pthread   *
+ * Usage: otpasync.exe [COMPRESS] [HYBRID] [CACHE] [LOAD] [count]                          *
+ *                                                                                         *
+ * An example of the interface in otpasync.hpp. "msg.in" is encrypted count times (100 by  *
+ * default) all at once - to async1.enc, async2.enc, ... each with its own seed from       *
+ * "next_seed.txt" - and then those files are all decrypted at once (to async1.dec, ...)   *
+ * and checked against "msg.in". One more encryption is started and cancelled as soon as   *
+ * it reports progress. Two compute threads do all of the work, and everything is driven   *
+ * from a poll() loop on the event_loop's fd, as it would be in a service.                 *
+ *                                                                                         *
+ * With "LOAD", two 8 MiB encryptions (bulk jobs) run alongside all of that, and the queue *
+ * latency of each class is printed at the end - the small messages should hardly notice.  *
+ * With a "msg.in" of no more than OTP_ASYNC_SMALL bytes, every one of its encryptions and *
+ * decryptions must be counted as interactive, and their p99 must be under                 *
+ * OTP_ASYNC_AGE_MS (the wait after which even a bulk job goes first). The one that was    *
+ * cancelled must be counted among them too, as failed.                                    *
+ *                                                                                         *
+ * With "CACHE" the context keeps the decryption pads, and the files are all decrypted a   *
+ * second time - which should be served entirely from the cache, with no pad refused (the  *
+ * pads are mlock()'d, so RLIMIT_MEMLOCK must allow for them). Then a long and a short     *
+ * message are encrypted with the same seed, and once the long one has been decrypted the  *
+ * short one must be decrypted from the first blocks of its cached pad.                    *
+ *                                                                                         *
+ * The .enc and .dec files are removed afterwards. Prints "ok" if all went as expected.    *
+ *******************************************************************************************/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* for O_DIRECT in otpio.h (g++ defines it anyway) */
+#endif
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <string>
+#include "otpasync.hpp"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+
+/* A bulk job for LOAD - with parameters, not captures, so that they live in the coroutine *
+ * frame. Its deadline is already past, so it must be counted as missed.                   */
+static otp::task<void> bulk(otp::context &ctx, std::size_t len) {
+  otp::options opt;
+  opt.deadline = otp::clock::now();
+  std::string enc = co_await ctx.encrypt(std::string(len, 'x'), opt);
+  if(enc.size() < len) throw otp::error("bulk encryption is short");
+}
+
+static std::string read_file(const char *name) {
+  std::string s;
+  char buf[256];
+  std::size_t n;
+  FILE *fp = fopen(name, "rb");
+
+  if(fp == NULL) throw otp::error(std::string("unable to read ") + name);
+  while((n = fread(buf, 1, sizeof(buf), fp)) > 0) s.append(buf, n);
+  fclose(fp);
+  return s;
+}
+
+static void write_file(const char *name, const std::string &s) {
+  FILE *fp = fopen(name, "wb");
+
+  if(fp == NULL || fwrite(s.data(), 1, s.size(), fp) != s.size() || fclose(fp))
+    throw otp::error(std::string("unable to write ") + name);
+}
+
+/* For CACHE - a long and a short message with the same seed (next_seed.txt is put back in *
+ * between, which must never be done with real messages). After the long one, the short   *
+ * one must be a cache hit, decrypted from the start of the long one's pad.                 */
+static otp::task<void> same_seed(otp::context &ctx) {
+  std::string seed = read_file("next_seed.txt"), lmsg(65536, 0), smsg(1000, 0);
+  std::size_t i;
+
+  for(i = 0; i < lmsg.size(); i++) lmsg[i] = (char)rand();
+  for(i = 0; i < smsg.size(); i++) smsg[i] = (char)rand();
+  lmsg[0] = smsg[0] = 'x'; /* a plain message mustn't start with a NULL byte */
+
+  std::string lenc = co_await ctx.encrypt(lmsg);
+  write_file("next_seed.txt", seed);
+  std::string senc = co_await ctx.encrypt(smsg);
+  if(lenc.substr(0, lenc.find('?')) != senc.substr(0, senc.find('?')))
+    throw otp::error("same seed: the two messages have different seeds");
+
+  otp::cache_stats a = ctx.cache_counters();
+  if(co_await ctx.decrypt(lenc) != lmsg) throw otp::error("same seed: the long message didn't decrypt");
+  if(co_await ctx.decrypt(senc) != smsg) throw otp::error("same seed: the short message didn't decrypt");
+  otp::cache_stats b = ctx.cache_counters();
+
+  printf("same seed: cache hits %lu, misses %lu, refused %lu\n", b.hits - a.hits, b.misses - a.misses,
+         b.refused - a.refused);
+  if(b.misses != a.misses + 1 || b.hits != a.hits + 1 || b.refused != a.refused)
+    throw otp::error("same seed: the short message wasn't decrypted from the long one's pad");
+}
+
+int main(int argc, char *argv[]) {
+ int count = 100, failed = 0, i;
+ std::size_t pending = 0;
+ std::atomic<int> reports{0}; /* progress is reported from the compute threads */
+ bool was_cancelled = false, cache = false, load = false;
+ otp::options opt;
+ std::stop_source stop;
+
+ for(i = 1; i < argc; i++) {
+   if(!strcmp(argv[i], "COMPRESS")) opt.compress = true;
+   else if(!strcmp(argv[i], "HYBRID")) opt.hybrid = true;
+   else if(!strcmp(argv[i], "CACHE")) cache = true;
+   else if(!strcmp(argv[i], "LOAD")) load = true;
+   else if(atoi(argv[i]) > 0) count = atoi(argv[i]);
+   else {
+     printf("Usage: otpasync.exe [COMPRESS] [HYBRID] [CACHE] [LOAD] [count]\n");
+     exit(1);
+   }
+ }
+
+ try {
+   otp::event_loop loop;
+   otp::context ctx(2, &loop);
+
+   if(cache) {
+#if defined(__unix__) || defined(__APPLE__)
+     /* every cached pad is mlock()'d - allow as much as this process may lock */
+     struct rlimit rl;
+     if(!getrlimit(RLIMIT_MEMLOCK, &rl) && rl.rlim_cur != rl.rlim_max) {
+       rl.rlim_cur = rl.rlim_max;
+       setrlimit(RLIMIT_MEMLOCK, &rl);
+     }
+#endif
+     ctx.cache(16 << 20, 3600);
+   }
+
+   /* every completion arrives on this thread, so there's no locking here */
+   auto start = [&](otp::task<void> t) {
+     pending++;
+     otp::detach(std::move(t), [&](std::exception_ptr e) {
+       pending--;
+       if(!e) return;
+       try {
+         std::rethrow_exception(e);
+       }
+       catch(const std::exception &x) {
+         printf("%s\n", x.what());
+         failed++;
+       }
+     });
+   };
+
+   auto run = [&] {
+     while(pending) loop.run_once();
+   };
+
+   if(load) {
+     start(bulk(ctx, 8 << 20));
+     start(bulk(ctx, 8 << 20));
+   }
+
+   for(i = 1; i <= count; i++)
+     start(ctx.encrypt_file("msg.in", "async" + std::to_string(i) + ".enc", opt));
+
+   pending++;
+   otp::detach(ctx.encrypt_file("msg.in", "async0.enc", opt, stop.get_token(),
+                                [&](std::size_t, std::size_t) { stop.request_stop(); }),
+               [&](std::exception_ptr e) {
+                 pending--;
+                 try {
+                   if(e) std::rethrow_exception(e);
+                 }
+                 catch(const otp::cancelled &) {
+                   was_cancelled = true;
+                 }
+                 catch(...) {
+                 }
+               });
+
+   run();
+   printf("%d encryptions done (%d failed), cancellation %s\n", count, failed, was_cancelled ? "worked" : "FAILED");
+
+   for(i = 1; i <= count; i++)
+     start(ctx.decrypt_file("async" + std::to_string(i) + ".enc", "async" + std::to_string(i) + ".dec", {}, {},
+                            [&](std::size_t, std::size_t) { reports++; }));
+
+   run();
+   printf("%d decryptions done (%d failed, %d progress reports)\n", count, failed, reports.load());
+
+   if(cache) {
+     for(i = 1; i <= count; i++)
+       start(ctx.decrypt_file("async" + std::to_string(i) + ".enc", "async" + std::to_string(i) + ".dec"));
+
+     run();
+     otp::cache_stats s = ctx.cache_counters();
+     printf("%d decryptions again (%d failed): cache hits %lu, misses %lu, refused %lu, %zu bytes locked\n", count,
+            failed, s.hits, s.misses, s.refused, s.bytes);
+     if(s.refused) printf("pads were refused - RLIMIT_MEMLOCK (ulimit -l) is too small for this test\n");
+     if(s.hits != (unsigned long)count || s.refused) failed++;
+
+     start(same_seed(ctx));
+     run();
+   }
+
+   std::string want = otp::sync_wait([&]() -> otp::task<std::string> {
+     otp::buffer b = co_await ctx.io().read("msg.in");
+     co_return std::string(b.data.get(), b.size);
+   }());
+
+   for(i = 1; i <= count; i++) {
+     std::string name = "async" + std::to_string(i);
+     FILE *fp = fopen((name + ".dec").c_str(), "rb");
+     std::string got;
+     char buf[65536];
+     std::size_t n;
+
+     if(fp != NULL) {
+       while((n = fread(buf, 1, sizeof(buf), fp)) > 0) got.append(buf, n);
+       fclose(fp);
+     }
+
+     if(got != want) {
+       printf("%s.dec differs from msg.in\n", name.c_str());
+       failed++;
+     }
+
+     remove((name + ".enc").c_str());
+     remove((name + ".dec").c_str());
+   }
+
+   remove("async0.enc");
+
+   if(load) {
+     static const char *names[] = {"interactive", "normal", "bulk"};
+     auto s = ctx.scheduler_stats();
+     for(i = 0; i < otp::priorities; i++)
+       printf("%s: %lu done (%lu late, %lu failed), queue latency p50 %.0f us, p99 %.0f us, max %.0f us\n",
+              names[i], s[i].done, s[i].missed, s[i].failed, s[i].p50_us, s[i].p99_us, s[i].max_us);
+     if(s[(int)otp::priority::bulk].done != 2 || s[(int)otp::priority::bulk].missed != 2) failed++;
+     if(want.size() <= OTP_ASYNC_SMALL) {
+       otp::class_stats &t = s[(int)otp::priority::interactive];
+       if(t.done < 2 * (unsigned long)count || t.p99_us >= OTP_ASYNC_AGE_MS * 1000.0) {
+         printf("the small messages were held up (or not counted as interactive)\n");
+         failed++;
+       }
+       /* the cancelled encryption must be counted too - as done, and failed */
+       if(t.done < 2 * (unsigned long)count + 1 || t.failed != 1) {
+         printf("the cancelled encryption was not accounted for\n");
+         failed++;
+       }
+     }
+   }
+ }
+ catch(const std::exception &x) {
+   printf("%s\n", x.what());
+   exit(1);
+ }
+
+ if(failed || !was_cancelled) exit(1);
+
+ printf("ok\n");
+ return 0;
+}
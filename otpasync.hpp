@@ -0,0 +1,951 @@
+/*******************************************************************************************
+ * Copyright 2020 sisyphus                                                                 *
+ *                                                                                         *
+ * otpasync.hpp - a C++20 coroutine interface to encryption and decryption, for programs  *
+ * built around an event loop. (Linux only - it needs eventfd.) Build with eg:            *
+ *   g++ -std=c++20 -o prog prog.cpp -lgmp -pthread                                        *
+ *                                                                                         *
+ * otp::context holds the key from "primes.in" and three executors:                       *
+ *                                                                                         *
+ *  compute_pool - a fixed number of threads on which the pad is generated. A task gives  *
+ *                 up its thread after every OTP_ASYNC_SLICE generator steps, so however  *
+ *                 many tasks there are, they all make progress on those few threads.     *
+ *                 Each operation is a job in one of three classes - interactive, normal  *
+ *                 and bulk - and a freed thread goes to the highest class with work      *
+ *                 queued (the earliest deadline first, within a class). So a message    *
+ *                 that needs one step waits for at most a slice, however many long jobs *
+ *                 are running - and bulk jobs never take the last OTP_ASYNC_RESERVE      *
+ *                 threads, since some of their steps are long. (So the pool has at least *
+ *                 OTP_ASYNC_RESERVE + 1 threads, however few CPUs there are.) A class     *
+ *                 kept waiting OTP_ASYNC_AGE_MS is served anyway.                         *
+ *  io_engine    - one thread that gathers the file reads and writes of every task into  *
+ *                 otpio.h batches (io_uring, where the kernel has it). When a batch      *
+ *                 completes, its tasks are resumed on the compute_pool.                  *
+ *  event_loop   - optional, and owned by the caller: the thread that runs it gets back    *
+ *                 the completion of every task started through the context. Its fd()    *
+ *                 becomes readable when there's something to resume - add it to the      *
+ *                 caller's poll()/epoll set and call run_ready().                         *
+ *                                                                                         *
+ * Every operation takes options - whose priority is by default chosen from the length of  *
+ * the message (see otp::priority) and whose deadline, if given, is counted as met or not *
+ * - and scheduler_stats() reports the p50/p99 queue latency of each class.               *
+ *                                                                                         *
+ * Every operation takes a std::stop_token - a stop request makes it throw otp::cancelled  *
+ * at its next check (between slices of the pad, and around its I/O) - and a progress     *
+ * function, which is called on a compute thread with the bytes of pad generated so far  *
+ * and the number needed. Failures throw otp::error. (The functions of otpmsg.h have      *
+ * already printed the details, as they do for encrypt.exe and decrypt.exe.)              *
+ *                                                                                         *
+ * Each encryption takes its own seed from "next_seed.txt", just as encrypt.exe does, and  *
+ * writes the same "msg.enc" format, so decrypt.exe reads the results and vice versa.     *
+ *                                                                                         *
+ * A service that decrypts the same messages many times can call context::cache() to keep  *
+ * their pads (in locked memory - see otpcache.h), so that decrypting one again costs only *
+ * the XOR. cache_counters() reports how well that's working.                              *
+ *                                                                                         *
+ * If there's an "otp.tune" (see otptune.h) for the key, the context applies it, and takes  *
+ * the size of its compute_pool from there unless told otherwise.                          *
+ *                                                                                         *
+ * otpasync.cpp shows the whole thing being driven from a poll() loop.                     *
+ *******************************************************************************************/
+
+#ifndef OTPASYNC_HPP
+#define OTPASYNC_HPP
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <coroutine>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <stop_token>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+
+#include "otp.h"
+#include "otpz.h"
+#include "chacha20.h"
+#include "otpio.h"
+#include "otpmsg.h"
+#include "otptune.h"
+#include "otpcache.h"
+
+#define OTP_ASYNC_SLICE 64         /* generator steps (~100us) between yields, cancellation checks and progress reports */
+#define OTP_ASYNC_SMALL 16384      /* messages up to this many bytes are interactive...                                  */
+#define OTP_ASYNC_LARGE (1 << 20)  /* ...and those of more than this are bulk, unless a priority is given              */
+#define OTP_ASYNC_AGE_MS 100       /* a lower class waiting this long is served ahead of higher ones                    */
+#define OTP_ASYNC_RESERVE 1        /* threads that bulk steps may not take (the pool always has more than this)         */
+#define OTP_ASYNC_SAMPLES 4096     /* queue latencies kept per class                                                    */
+
+namespace otp {
+
+class error : public std::runtime_error {
+ public:
+  using std::runtime_error::runtime_error;
+};
+
+class cancelled : public error {
+ public:
+  cancelled() : error("otp: cancelled") {}
+};
+
+/* Called with the bytes of pad generated so far and the number needed. */
+using progress_fn = std::function<void(std::size_t done, std::size_t total)>;
+
+/* Scheduling classes, highest first. "automatic" picks one by the length of the message *
+ * (from a stat() of the file, for the _file operations) before the job is first queued: *
+ * up to OTP_ASYNC_SMALL bytes is interactive, more than OTP_ASYNC_LARGE is bulk, and    *
+ * anything between is normal.                                                           */
+enum class priority { interactive, normal, bulk, automatic };
+constexpr int priorities = 3;
+
+using clock = std::chrono::steady_clock;
+
+struct options {
+  bool hybrid = false;   /* these two are for encryption only - decryption */
+  bool compress = false; /* reads them from the header                     */
+  priority prio = priority::automatic;
+  clock::time_point deadline = clock::time_point::max(); /* max = none */
+};
+
+/* How an operation is scheduled on the compute_pool - it lasts as long as the operation. */
+struct job {
+  priority cls = priority::normal;
+  clock::time_point deadline = clock::time_point::max();
+};
+
+/* Per class counters of the compute_pool. The queue latencies (from being queued to being *
+ * resumed) are over the last OTP_ASYNC_SAMPLES times that tasks of the class were queued. */
+struct class_stats {
+  unsigned long queued = 0, done = 0;
+  unsigned long missed = 0; /* done after its deadline                        */
+  unsigned long failed = 0; /* done by an exception (cancellation included) */
+  double p50_us = 0, p99_us = 0, max_us = 0;
+};
+
+/* The counters of the context's pad cache (see otpcache.h). */
+struct cache_stats {
+  unsigned long hits = 0, misses = 0, evicted = 0, expired = 0, refused = 0;
+  std::size_t entries = 0, bytes = 0;
+};
+
+/* A buffer from malloc()/otpio_alloc(), as the C code wants. */
+struct buffer {
+  std::unique_ptr<char, void (*)(void *)> data{nullptr, std::free};
+  std::size_t size = 0;
+
+  char *release() { return data.release(); }
+};
+
+/*************************************** task<T> ******************************************/
+
+namespace detail {
+
+struct promise_base {
+  std::coroutine_handle<> cont;
+  std::exception_ptr exc;
+
+  struct final_awaiter {
+    bool await_ready() noexcept { return false; }
+    template <class P>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+      auto c = h.promise().cont;
+      return c ? c : std::noop_coroutine();
+    }
+    void await_resume() noexcept {}
+  };
+
+  std::suspend_always initial_suspend() noexcept { return {}; }
+  final_awaiter final_suspend() noexcept { return {}; }
+  void unhandled_exception() { exc = std::current_exception(); }
+};
+
+template <class T>
+struct promise_value : promise_base {
+  std::optional<T> value;
+  void return_value(T v) { value.emplace(std::move(v)); }
+  T take() { return std::move(*value); }
+};
+
+template <>
+struct promise_value<void> : promise_base {
+  void return_void() {}
+  void take() {}
+};
+
+} // namespace detail
+
+/* A coroutine that starts when it's co_await'ed, and resumes its awaiter when done. */
+template <class T = void>
+class [[nodiscard]] task {
+ public:
+  struct promise_type : detail::promise_value<T> {
+    task get_return_object() { return task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+  };
+
+  task(task &&o) noexcept : h_(std::exchange(o.h_, {})) {}
+  task &operator=(task &&o) noexcept {
+    if(this != &o) {
+      if(h_) h_.destroy();
+      h_ = std::exchange(o.h_, {});
+    }
+    return *this;
+  }
+  ~task() { if(h_) h_.destroy(); }
+
+  bool await_ready() const noexcept { return false; }
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> c) noexcept {
+    h_.promise().cont = c;
+    return h_;
+  }
+  T await_resume() {
+    if(h_.promise().exc) std::rethrow_exception(h_.promise().exc);
+    return h_.promise().take();
+  }
+
+ private:
+  explicit task(std::coroutine_handle<promise_type> h) : h_(h) {}
+  std::coroutine_handle<promise_type> h_;
+};
+
+/************************************** executors *****************************************/
+
+class compute_pool {
+ public:
+  /* threads: 0 = one per CPU. There are never fewer than OTP_ASYNC_RESERVE + 1 - even on one *
+   * CPU - or a bulk step would have every thread, and nothing else could start until it   *
+   * was done.                                                                              */
+  explicit compute_pool(unsigned threads = 0) {
+    if(!threads) threads = std::thread::hardware_concurrency();
+    threads = std::max(threads, OTP_ASYNC_RESERVE + 1u);
+    bulk_max_ = threads - OTP_ASYNC_RESERVE;
+    for(auto &l : lat_) l.reserve(OTP_ASYNC_SAMPLES);
+    for(unsigned i = 0; i < threads; i++)
+      threads_.emplace_back([this](std::stop_token st) { run(st); });
+  }
+
+  compute_pool(const compute_pool &) = delete;
+  compute_pool &operator=(const compute_pool &) = delete;
+
+  /* Queue h to run as part of j (nullptr = a normal job with no deadline). */
+  void post(std::coroutine_handle<> h, const job *j) {
+    int c = j ? (int)j->cls : (int)priority::normal;
+    {
+      std::lock_guard<std::mutex> l(m_);
+      q_[c].push_back({h, j, clock::now()});
+      stats_[c].queued++;
+    }
+    cv_.notify_one();
+  }
+
+  /* The job whose step is running on this thread, if any. */
+  static const job *current() { return current_; }
+
+  /* co_await pool.schedule(&j) continues on one of the pool's threads, as part of j. With *
+   * no argument it stays part of the job that's running - so that's how a step yields.   */
+  auto schedule(const job *j = current()) {
+    struct awaiter {
+      compute_pool *p;
+      const job *j;
+      bool await_ready() const noexcept { return false; }
+      void await_suspend(std::coroutine_handle<> h) { p->post(h, j); }
+      void await_resume() const noexcept {}
+    };
+    return awaiter{this, j};
+  }
+
+  /* Count j as done, whether it met its deadline, and whether it failed (or was cancelled). */
+  void finished(const job &j, bool failed) {
+    std::lock_guard<std::mutex> l(m_);
+    stats_[(int)j.cls].done++;
+    if(clock::now() > j.deadline) stats_[(int)j.cls].missed++;
+    if(failed) stats_[(int)j.cls].failed++;
+  }
+
+  std::array<class_stats, priorities> stats() {
+    std::array<class_stats, priorities> s;
+    std::vector<float> v;
+
+    std::lock_guard<std::mutex> l(m_);
+    for(int c = 0; c < priorities; c++) {
+      s[c] = stats_[c];
+      if(lat_[c].empty()) continue;
+      v = lat_[c];
+      std::sort(v.begin(), v.end());
+      s[c].p50_us = v[v.size() / 2];
+      s[c].p99_us = v[v.size() * 99 / 100];
+      s[c].max_us = v.back();
+    }
+    return s;
+  }
+
+  std::size_t size() const { return threads_.size(); }
+
+ private:
+  struct entry {
+    std::coroutine_handle<> h;
+    const job *j;
+    clock::time_point queued;
+  };
+
+  /* Whether class c has an entry that may run now. A step of a bulk job can't be          *
+   * preempted - and the first and last steps of a long message (its import, and the XOR) *
+   * are long - so bulk steps are kept off OTP_ASYNC_RESERVE of the threads.              */
+  bool ready(int c) const {
+    return !q_[c].empty() && (c != (int)priority::bulk || bulk_running_ < bulk_max_);
+  }
+
+  /* The next entry to run - with m_ held and ready() for some class. A lower class that's *
+   * been kept waiting for OTP_ASYNC_AGE_MS goes first; otherwise it's the highest class,  *
+   * and the earliest deadline within it (first come, first served among equals).         */
+  entry pick(int &c) {
+    clock::time_point now = clock::now();
+    int i, best = 0;
+
+    for(c = priorities - 1; c > 0; c--)
+      if(ready(c) && now - q_[c].front().queued >= std::chrono::milliseconds(OTP_ASYNC_AGE_MS)) break;
+    if(!c)
+      for(c = 0; !ready(c); c++);
+
+    std::deque<entry> &q = q_[c];
+    for(i = 1; i < (int)q.size(); i++)
+      if(q[i].j && (!q[best].j || q[i].j->deadline < q[best].j->deadline)) best = i;
+
+    entry e = q[best];
+    q.erase(q.begin() + best);
+
+    std::vector<float> &l = lat_[c];
+    float us = std::chrono::duration<float, std::micro>(now - e.queued).count();
+    if(l.size() < OTP_ASYNC_SAMPLES) l.push_back(us);
+    else l[next_[c]++ % OTP_ASYNC_SAMPLES] = us;
+
+    return e;
+  }
+
+  void run(std::stop_token st) {
+    for(;;) {
+      entry e;
+      int c;
+      {
+        std::unique_lock<std::mutex> l(m_);
+        if(!cv_.wait(l, st, [this] {
+             for(int c = 0; c < priorities; c++)
+               if(ready(c)) return true;
+             return false;
+           }))
+          return;
+        e = pick(c);
+        if(c == (int)priority::bulk) bulk_running_++;
+      }
+      current_ = e.j;
+      e.h.resume();
+      current_ = nullptr;
+      if(c == (int)priority::bulk) {
+        {
+          std::lock_guard<std::mutex> l(m_);
+          bulk_running_--;
+        }
+        cv_.notify_one();
+      }
+    }
+  }
+
+  static inline thread_local const job *current_ = nullptr;
+
+  std::mutex m_;
+  std::condition_variable_any cv_;
+  std::deque<entry> q_[priorities];
+  class_stats stats_[priorities];
+  std::vector<float> lat_[priorities];
+  std::size_t next_[priorities] = {};
+  unsigned bulk_max_, bulk_running_ = 0;
+  std::vector<std::jthread> threads_; /* last, so the threads are joined first */
+};
+
+class event_loop {
+ public:
+  event_loop() : fd_(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) {
+    if(fd_ < 0) throw error("otp: eventfd failed");
+  }
+  ~event_loop() { close(fd_); }
+
+  event_loop(const event_loop &) = delete;
+  event_loop &operator=(const event_loop &) = delete;
+
+  /* Readable whenever run_ready() has something to do. */
+  int fd() const { return fd_; }
+
+  void post(std::coroutine_handle<> h) {
+    std::uint64_t one = 1;
+    {
+      std::lock_guard<std::mutex> l(m_);
+      q_.push_back(h);
+    }
+    if(write(fd_, &one, sizeof(one)) != sizeof(one)) { /* the counter is already non-zero */ }
+  }
+
+  auto schedule() {
+    struct awaiter {
+      event_loop *l;
+      bool await_ready() const noexcept { return false; }
+      void await_suspend(std::coroutine_handle<> h) { l->post(h); }
+      void await_resume() const noexcept {}
+    };
+    return awaiter{this};
+  }
+
+  /* Resume everything that's been handed back to the loop. Returns how many there were. */
+  std::size_t run_ready() {
+    std::uint64_t n;
+    std::deque<std::coroutine_handle<>> q;
+
+    if(read(fd_, &n, sizeof(n)) < 0) { /* nothing was pending */ }
+    {
+      std::lock_guard<std::mutex> l(m_);
+      q.swap(q_);
+    }
+    for(auto h : q) h.resume();
+    return q.size();
+  }
+
+  /* For a loop with nothing else to do: wait up to timeout_ms, then run_ready(). */
+  std::size_t run_once(int timeout_ms = -1) {
+    struct pollfd p = {fd_, POLLIN, 0};
+    if(poll(&p, 1, timeout_ms) <= 0) return 0;
+    return run_ready();
+  }
+
+ private:
+  int fd_;
+  std::mutex m_;
+  std::deque<std::coroutine_handle<>> q_;
+};
+
+/* One thread that does every task's file I/O, batching whatever has queued up. */
+class io_engine {
+  struct op {
+    enum { READ, WRITE, CALL } kind;
+    std::string fname;
+    std::size_t max = 0, len = 0;
+    const char *data = nullptr;
+    buffer buf;
+    std::function<int()> fn;
+    int ret = 0;
+    std::coroutine_handle<> h;
+    const job *j = nullptr; /* the job it's resumed as */
+  };
+
+  auto submit(op &o) {
+    struct awaiter {
+      io_engine *e;
+      op *o;
+      bool await_ready() const noexcept { return false; }
+      void await_suspend(std::coroutine_handle<> h) {
+        o->h = h;
+        o->j = compute_pool::current();
+        {
+          std::lock_guard<std::mutex> l(e->m_);
+          e->q_.push_back(o);
+        }
+        e->cv_.notify_one();
+      }
+      void await_resume() const noexcept {}
+    };
+    return awaiter{this, &o};
+  }
+
+ public:
+  explicit io_engine(compute_pool &pool) : pool_(pool), thread_([this](std::stop_token st) { run(st); }) {}
+
+  io_engine(const io_engine &) = delete;
+  io_engine &operator=(const io_engine &) = delete;
+
+  /* The whole of fname, NULL terminated. */
+  task<buffer> read(std::string fname, std::size_t max = 536870912) {
+    op o;
+    o.kind = op::READ;
+    o.fname = std::move(fname);
+    o.max = max;
+    co_await submit(o);
+    if(o.ret) throw error("otp: unable to read " + o.fname);
+    co_return std::move(o.buf);
+  }
+
+  task<void> write(std::string fname, const char *data, std::size_t len) {
+    op o;
+    o.kind = op::WRITE;
+    o.fname = std::move(fname);
+    o.data = data;
+    o.len = len;
+    co_await submit(o);
+    if(o.ret) throw error("otp: unable to write " + o.fname);
+  }
+
+  /* Run fn on the I/O thread - for small jobs, like taking a seed, that must not overlap. */
+  task<int> call(std::function<int()> fn) {
+    op o;
+    o.kind = op::CALL;
+    o.fn = std::move(fn);
+    co_await submit(o);
+    co_return o.ret;
+  }
+
+ private:
+  void run(std::stop_token st) {
+    std::vector<op *> ops;
+    std::vector<otpio_file> files;
+    std::vector<op *> file_ops;
+
+    for(;;) {
+      {
+        std::unique_lock<std::mutex> l(m_);
+        if(!cv_.wait(l, st, [this] { return !q_.empty(); })) return;
+        ops.assign(q_.begin(), q_.end());
+        q_.clear();
+      }
+
+      files.clear();
+      file_ops.clear();
+
+      for(op *o : ops) {
+        otpio_file f;
+        std::memset(&f, 0, sizeof(f));
+
+        if(o->kind == op::CALL) {
+          o->ret = o->fn();
+          continue;
+        }
+
+        if(o->kind == op::READ) {
+          std::size_t len;
+          if(otpio_size(o->fname.c_str(), &len, o->max)) {
+            o->ret = 1;
+            continue;
+          }
+          o->buf.data.reset(otpio_alloc(len));
+          o->buf.size = len;
+          if(!o->buf.data) {
+            o->ret = 1;
+            continue;
+          }
+          f.buf = o->buf.data.get();
+          f.len = len;
+        }
+        else {
+          f.buf = const_cast<char *>(o->data);
+          f.len = o->len;
+          f.write = 1;
+        }
+
+        f.fname = o->fname.c_str();
+        files.push_back(f);
+        file_ops.push_back(o);
+      }
+
+      /* One batch for all of them - and if that fails, one at a time to see which. */
+      if(!files.empty() && otpio_transfer(files.data(), (int)files.size())) {
+        for(std::size_t i = 0; i < files.size(); i++)
+          file_ops[i]->ret = otpio_transfer(&files[i], 1);
+      }
+
+      for(op *o : file_ops)
+        if(!o->ret && o->kind == op::READ) o->buf.data.get()[o->buf.size] = 0;
+
+      for(op *o : ops) pool_.post(o->h, o->j);
+    }
+  }
+
+  compute_pool &pool_;
+  std::mutex m_;
+  std::condition_variable_any cv_;
+  std::deque<op *> q_;
+  std::jthread thread_; /* last, so the thread is joined first */
+};
+
+/*************************************** context ******************************************/
+
+namespace detail {
+
+/* otp_msg and mpz_t, cleared however the coroutine ends. */
+struct msg_guard {
+  otp_msg m;
+  explicit msg_guard(buffer b) {
+    std::size_t n = b.size;
+    otp_msg_init(&m, b.release(), n);
+  }
+  ~msg_guard() { otp_msg_clear(&m); }
+};
+
+struct mpz_guard {
+  mpz_t z;
+  mpz_guard() { mpz_init(z); }
+  ~mpz_guard() { mpz_clear(z); }
+};
+
+/* compute_pool::finished() for a job, however the coroutine ends - a failure, unless ok is set. */
+struct job_guard {
+  compute_pool &pool;
+  const job &j;
+  bool ok = false;
+  job_guard(compute_pool &p, const job &jb) : pool(p), j(jb) {}
+  ~job_guard() { pool.finished(j, !ok); }
+};
+
+} // namespace detail
+
+class context {
+ public:
+  /* threads: size of the compute pool (0 = as otp.tune says, or else one per CPU - and  *
+   *          at least OTP_ASYNC_RESERVE + 1 either way, see compute_pool).              *
+   * loop: where completions are handed back (nullptr = wherever the last step ran).     */
+  explicit context(unsigned threads = 0, event_loop *loop = nullptr, std::string primes = "primes.in",
+                   std::string next_seed = "next_seed.txt", int userid = 1000000000)
+      : next_seed_(std::move(next_seed)), userid_(userid), loop_(loop) {
+    if(otp_load_key(primes.c_str(), &key_)) throw error("otp: unable to use " + primes);
+    otp_tune tune;
+    if(!otp_tune_load(OTP_TUNE_FILE, &tune) && !otp_tune_apply(&tune, &key_) && !threads) threads = tune.threads;
+    if(chacha20_selftest()) {
+      mpz_clear(key_.z_phi);
+      throw error("otp: ChaCha20 self test failed");
+    }
+    otp_cache_init(&cache_, 0, 0);
+    pool_ = std::make_unique<compute_pool>(threads);
+    io_ = std::make_unique<io_engine>(*pool_);
+  }
+
+  ~context() {
+    io_.reset();
+    pool_.reset();
+    otp_cache_clear(&cache_);
+    mpz_clear(key_.z_phi);
+  }
+
+  context(const context &) = delete;
+  context &operator=(const context &) = delete;
+
+  compute_pool &pool() { return *pool_; }
+  io_engine &io() { return *io_; }
+  const otp_key &key() const { return key_; }
+
+  /* Keep the pads of up to max_bytes of decrypted messages (0 = no cache, the default), *
+   * each for at most ttl seconds (0 = until evicted). Any cached pads are wiped.        */
+  void cache(std::size_t max_bytes, unsigned ttl = 0) {
+    std::lock_guard<std::mutex> l(cache_m_);
+    otp_cache_clear(&cache_);
+    cache_.max_bytes = max_bytes;
+    cache_.ttl = ttl;
+  }
+
+  cache_stats cache_counters() {
+    std::lock_guard<std::mutex> l(cache_m_);
+    cache_stats s;
+    s.hits = cache_.hits;
+    s.misses = cache_.misses;
+    s.evicted = cache_.evicted;
+    s.expired = cache_.expired;
+    s.refused = cache_.refused;
+    s.entries = cache_.entries;
+    s.bytes = cache_.bytes;
+    return s;
+  }
+
+  /* msg as the contents of a msg.enc. */
+  task<std::string> encrypt(std::string msg, options opt = {}, std::stop_token st = {}, progress_fn progress = {}) {
+    return on_loop(encrypt_string(copy(msg), opt, st, std::move(progress)));
+  }
+
+  /* The contents of a msg.enc, decrypted. */
+  task<std::string> decrypt(std::string enc, options opt = {}, std::stop_token st = {}, progress_fn progress = {}) {
+    return on_loop(decrypt_string(copy(enc), opt, st, std::move(progress)));
+  }
+
+  task<void> encrypt_file(std::string in, std::string out, options opt = {}, std::stop_token st = {},
+                          progress_fn progress = {}) {
+    return on_loop(encrypt_file_(std::move(in), std::move(out), opt, st, std::move(progress)));
+  }
+
+  task<void> decrypt_file(std::string in, std::string out, options opt = {}, std::stop_token st = {},
+                          progress_fn progress = {}) {
+    return on_loop(decrypt_file_(std::move(in), std::move(out), opt, st, std::move(progress)));
+  }
+
+  /* Queue latency and deadline counts for each class - interactive, normal and bulk. */
+  std::array<class_stats, priorities> scheduler_stats() { return pool_->stats(); }
+
+ private:
+  static buffer copy(const std::string &s) {
+    buffer b;
+    b.data.reset(otpio_alloc(s.size()));
+    if(!b.data) throw std::bad_alloc();
+    std::memcpy(b.data.get(), s.data(), s.size());
+    b.data.get()[s.size()] = 0;
+    b.size = s.size();
+    return b;
+  }
+
+  /* Finish t - however it ends - on the event loop, if there is one. */
+  template <class T>
+  task<T> on_loop(task<T> t) {
+    std::exception_ptr e;
+    std::optional<std::conditional_t<std::is_void_v<T>, int, T>> value;
+
+    try {
+      if constexpr(std::is_void_v<T>) co_await std::move(t);
+      else value.emplace(co_await std::move(t));
+    }
+    catch(...) {
+      e = std::current_exception();
+    }
+
+    if(loop_) co_await loop_->schedule();
+    if(e) std::rethrow_exception(e);
+    if constexpr(!std::is_void_v<T>) co_return std::move(*value);
+  }
+
+  static priority classify(std::size_t len) {
+    return len <= OTP_ASYNC_SMALL ? priority::interactive : len > OTP_ASYNC_LARGE ? priority::bulk : priority::normal;
+  }
+
+  /* The job for a message (or msg.enc) of len bytes - classed before it's first queued, so *
+   * that no step of a long message is ever counted (or run) as interactive.               */
+  static job make_job(const options &opt, std::size_t len) {
+    job j;
+    j.cls = opt.prio == priority::automatic ? classify(len) : opt.prio;
+    j.deadline = opt.deadline;
+    return j;
+  }
+
+  /* As make_job(), for a message still in the file fname - its length is taken from a stat() *
+   * on the caller's thread (one that fails leaves the read to report it).                   */
+  static job make_job(const options &opt, const std::string &fname) {
+    struct stat stbuf;
+    return make_job(opt, stat(fname.c_str(), &stbuf) ? 0 : (std::size_t)stbuf.st_size);
+  }
+
+  /* Put an "automatic" job back in its class, now that the message (or msg.enc) has been *
+   * read and is len bytes - in case the file changed after make_job(). Returns true if   *
+   * that moved it.                                                                       */
+  static bool admit(job &j, const options &opt, std::size_t len) {
+    priority was = j.cls;
+    if(opt.prio == priority::automatic) j.cls = classify(len);
+    return j.cls != was;
+  }
+
+  task<std::string> encrypt_string(buffer in, options opt, std::stop_token st, progress_fn progress) {
+    job j = make_job(opt, in.size);
+    detail::job_guard done(*pool_, j);
+    co_await pool_->schedule(&j);
+    buffer out = co_await encrypt_buffer(std::move(in), opt, j, st, progress);
+    done.ok = true;
+    co_return std::string(out.data.get(), out.size);
+  }
+
+  task<std::string> decrypt_string(buffer in, options opt, std::stop_token st, progress_fn progress) {
+    job j = make_job(opt, in.size);
+    detail::job_guard done(*pool_, j);
+    co_await pool_->schedule(&j);
+    std::string dec = co_await decrypt_buffer(std::move(in), "message", opt, j, st, progress);
+    done.ok = true;
+    co_return dec;
+  }
+
+  task<void> encrypt_file_(std::string in, std::string out, options opt, std::stop_token st, progress_fn progress) {
+    job j = make_job(opt, in);
+    detail::job_guard done(*pool_, j);
+    co_await pool_->schedule(&j);
+    buffer msg = co_await io_->read(in);
+    buffer enc = co_await encrypt_buffer(std::move(msg), opt, j, st, progress);
+    if(st.stop_requested()) throw cancelled();
+    co_await io_->write(out, enc.data.get(), enc.size);
+    done.ok = true;
+  }
+
+  task<void> decrypt_file_(std::string in, std::string out, options opt, std::stop_token st, progress_fn progress) {
+    job j = make_job(opt, in);
+    detail::job_guard done(*pool_, j);
+    co_await pool_->schedule(&j);
+    buffer enc = co_await io_->read(in);
+    std::string dec = co_await decrypt_buffer(std::move(enc), in, opt, j, st, progress);
+    if(st.stop_requested()) throw cancelled();
+    co_await io_->write(out, dec.data(), dec.size());
+    done.ok = true;
+  }
+
+  /* Run g to completion a slice at a time, checking st and reporting progress after each. */
+  task<void> generate(otp_gen &g, std::stop_token st, progress_fn &progress) {
+    std::size_t end;
+
+    for(;;) {
+      if(st.stop_requested()) throw cancelled();
+
+      end = std::min(g.its, g.done + OTP_ASYNC_SLICE);
+      while(g.done < end) otp_gen_step(&key_, &g);
+
+      if(progress) progress(std::min(g.done * key_.k, g.bitsize) / 8, (g.bitsize + 7) / 8);
+      if(st.stop_requested()) throw cancelled();
+      if(g.done == g.its) break;
+
+      co_await pool_->schedule(); /* let the other tasks have a turn */
+    }
+  }
+
+  /* These two run on the pool, as part of j. */
+  task<buffer> encrypt_buffer(buffer in, options opt, job &j, std::stop_token st, progress_fn &progress) {
+    int i_seed = 0;
+
+    /* before any work that takes time in proportion to the message */
+    if(admit(j, opt, in.size)) co_await pool_->schedule(); /* requeue in its class */
+
+    detail::msg_guard g(std::move(in));
+    detail::mpz_guard z_seed;
+
+    if(co_await io_->call([&] { return otp_next_seed(next_seed_.c_str(), 1, userid_, &i_seed); }))
+      throw error("otp: unable to take a seed from " + next_seed_);
+
+    g.m.i_seed = i_seed;
+    if(opt.hybrid) g.m.flags |= OTP_HYBRID;
+    if(opt.compress && otp_msg_compress(&g.m, 0)) throw error("otp: compression failed");
+
+    if(otp_seed(&key_, i_seed, z_seed.z) || otp_enc_begin(&key_, &g.m, z_seed.z))
+      throw error("otp: unable to encrypt this message");
+
+    co_await generate(g.m.gen, st, progress);
+
+    if(otp_enc_end(&key_, &g.m, nullptr)) throw error("otp: encryption failed");
+
+    buffer out;
+    out.data.reset(otpio_alloc(48 + g.m.out_len));
+    if(!out.data) throw std::bad_alloc();
+    out.size = otp_msg_header(out.data.get(), &g.m, 0);
+    std::memcpy(out.data.get() + out.size, g.m.out_buf, g.m.out_len);
+    out.size += g.m.out_len;
+    out.data.get()[out.size] = 0;
+
+    co_return out;
+  }
+
+  task<std::string> decrypt_buffer(buffer in, std::string name, options opt, job &j, std::stop_token st,
+                                   progress_fn &progress) {
+    if(admit(j, opt, in.size)) co_await pool_->schedule();
+
+    detail::msg_guard g(std::move(in));
+    detail::mpz_guard z_seed;
+
+    if(otp_msg_parse(&g.m, name.c_str()) || otp_seed(&key_, g.m.i_seed, z_seed.z) ||
+       otp_dec_begin(&key_, &g.m, z_seed.z))
+      throw error("otp: unable to decrypt " + name);
+
+    if(cache_get(g.m.gen, g.m.i_seed)) {
+      if(progress) progress((g.m.gen.bitsize + 7) / 8, (g.m.gen.bitsize + 7) / 8);
+    }
+    else {
+      co_await generate(g.m.gen, st, progress);
+      cache_put(g.m.gen, g.m.i_seed);
+    }
+
+    if(otp_dec_end(&key_, &g.m)) throw error("otp: decryption of " + name + " failed");
+
+    co_return std::string(g.m.out_buf, g.m.out_len);
+  }
+
+  bool cache_get(otp_gen &g, int i_seed) {
+    std::lock_guard<std::mutex> l(cache_m_);
+    return cache_.max_bytes && otp_cache_get(&cache_, &key_, i_seed, &g);
+  }
+
+  void cache_put(const otp_gen &g, int i_seed) {
+    std::lock_guard<std::mutex> l(cache_m_);
+    if(cache_.max_bytes) otp_cache_put(&cache_, &key_, i_seed, &g);
+  }
+
+  otp_key key_;
+  std::string next_seed_;
+  int userid_;
+  event_loop *loop_;
+  std::unique_ptr<compute_pool> pool_;
+  std::unique_ptr<io_engine> io_;
+  std::mutex cache_m_;
+  otp_cache cache_;
+};
+
+/*************************************** helpers ******************************************/
+
+namespace detail {
+
+struct detached {
+  struct promise_type {
+    detached get_return_object() { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+};
+
+inline detached run_detached(task<void> t, std::function<void(std::exception_ptr)> done) {
+  std::exception_ptr e;
+  try {
+    co_await std::move(t);
+  }
+  catch(...) {
+    e = std::current_exception();
+  }
+  if(done) done(e);
+}
+
+} // namespace detail
+
+/* Start t without waiting for it. done (if given) is called with its exception, if any, *
+ * on the thread that finished it - the context's event_loop, if it has one.            */
+inline void detach(task<void> t, std::function<void(std::exception_ptr)> done = {}) {
+  detail::run_detached(std::move(t), std::move(done));
+}
+
+/* Block until t is done - for code that has no event loop (t mustn't be from a context *
+ * that has one, as nothing would be running the loop to finish it).                    */
+template <class T>
+T sync_wait(task<T> t) {
+  std::mutex m;
+  std::condition_variable cv;
+  bool finished = false;
+  std::exception_ptr exc;
+  std::optional<std::conditional_t<std::is_void_v<T>, int, T>> value;
+
+  auto body = [&]() -> task<void> {
+    if constexpr(std::is_void_v<T>) co_await std::move(t);
+    else value.emplace(co_await std::move(t));
+  };
+
+  detach(body(), [&](std::exception_ptr e) {
+    std::lock_guard<std::mutex> l(m);
+    exc = e;
+    finished = true;
+    cv.notify_one();
+  });
+
+  std::unique_lock<std::mutex> l(m);
+  cv.wait(l, [&] { return finished; });
+  if(exc) std::rethrow_exception(exc);
+  if constexpr(!std::is_void_v<T>) return std::move(*value);
+}
+
+} // namespace otp
+
+#endif
@@ -0,0 +1,249 @@
+/*******************************************************************************************
+ * Copyright 2020 sisyphus                                                                 *
+ *                                                                                         *
+ * otpcache.h - a cache of decryption pads for programs that keep running and decrypt the  *
+ * same messages again and again (see otpasync.hpp). A pad depends only on the key and on  *
+ * the seed in the header of msg.enc, so once it has been generated, decrypting that       *
+ * message again need cost no more than the XOR.                                           *
+ *                                                                                         *
+ * Entries are keyed by a fingerprint of the key and by the seed. Each holds the pad as    *
+ * the generator left it (before otp_gen_finish()) - a pad of its blocks serves for any    *
+ * message with the same seed that needs no more than its blocks, because the blocks are   *
+ * laid out first to last from the top bit down. The cache is bounded by max_bytes: the    *
+ * least recently used entries are dropped to make room, and, if ttl is non-zero, entries  *
+ * are dropped ttl seconds after they were added whether they're used or not.              *
+ *                                                                                         *
+ * A pad is as secret as "primes.in", so each entry is kept in its own mlock()'d mapping   *
+ * (left out of core dumps where the system allows) and is wiped before it's released. A  *
+ * pad that can't be locked (see RLIMIT_MEMLOCK) isn't cached at all. Entry sizes - and so *
+ * max_bytes - are counted in whole pages.                                                 *
+ *                                                                                         *
+ * The counters record hits, misses, entries evicted to make room, entries that expired,   *
+ * and pads that were refused (too big, or not lockable). Nothing here locks: a cache      *
+ * shared between threads needs a mutex around each call.                                  *
+ *******************************************************************************************/
+
+#ifndef OTPCACHE_H
+#define OTPCACHE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <gmp.h>
+#include "otp.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#include <sys/mman.h>
+#define OTPCACHE_POSIX 1
+#endif
+
+typedef struct otp_cache_entry {
+ struct otp_cache_entry *prev, *next; /* most recently used first */
+ unsigned long long fp;
+ int i_seed;
+ size_t its, nlimbs, bytes;
+ time_t born;
+ mp_limb_t *pad;
+} otp_cache_entry;
+
+typedef struct {
+ size_t max_bytes, bytes, entries;
+ unsigned int ttl;
+ otp_cache_entry *head, *tail;
+ unsigned long hits, misses, evicted, expired, refused;
+} otp_cache;
+
+static inline void otp_cache_init(otp_cache *c, size_t max_bytes, unsigned int ttl) {
+ memset(c, 0, sizeof(*c));
+ c->max_bytes = max_bytes;
+ c->ttl = ttl;
+}
+
+/* Overwrite len bytes at p in a way that the compiler won't optimise away. */
+static inline void otp_cache_wipe(void *p, size_t len) {
+ volatile unsigned char *v = (volatile unsigned char*)p;
+
+ while(len--) *v++ = 0;
+}
+
+static inline void otp_cache_unlink(otp_cache *c, otp_cache_entry *x) {
+ if(x->prev) x->prev->next = x->next;
+ else c->head = x->next;
+ if(x->next) x->next->prev = x->prev;
+ else c->tail = x->prev;
+ x->prev = x->next = NULL;
+}
+
+static inline void otp_cache_push(otp_cache *c, otp_cache_entry *x) {
+ x->prev = NULL;
+ x->next = c->head;
+ if(c->head) c->head->prev = x;
+ else c->tail = x;
+ c->head = x;
+}
+
+/* Remove x from the cache, wiping its pad. */
+static inline void otp_cache_drop(otp_cache *c, otp_cache_entry *x) {
+ otp_cache_unlink(c, x);
+ c->bytes -= x->bytes;
+ c->entries--;
+
+ otp_cache_wipe(x->pad, x->bytes);
+#ifdef OTPCACHE_POSIX
+ munlock(x->pad, x->bytes);
+ munmap(x->pad, x->bytes);
+#else
+ free(x->pad);
+#endif
+ free(x);
+}
+
+/* Drop the entries that are more than ttl seconds old. */
+static inline void otp_cache_expire(otp_cache *c) {
+ otp_cache_entry *x, *prev;
+ time_t now;
+
+ if(!c->ttl) return;
+
+ now = time(NULL);
+ for(x = c->tail; x != NULL; x = prev) {
+   prev = x->prev;
+   if(now - x->born >= (time_t)c->ttl) {
+     otp_cache_drop(c, x);
+     c->expired++;
+   }
+ }
+}
+
+static inline otp_cache_entry *otp_cache_find(otp_cache *c, unsigned long long fp, int i_seed) {
+ otp_cache_entry *x;
+
+ for(x = c->head; x != NULL; x = x->next)
+   if(x->fp == fp && x->i_seed == i_seed) return x;
+
+ return NULL;
+}
+
+/* If the pad that g (just set up by otp_gen_init() from the seed i_seed) would generate *
+ * is in the cache, copy it into g and mark g as run to completion - g->z_seed is left   *
+ * where it was, so this is for decryption only. Returns 1 on a hit, 0 on a miss.        */
+static inline int otp_cache_get(otp_cache *c, const otp_key *key, int i_seed, otp_gen *g) {
+ otp_cache_entry *x;
+ size_t shift, s, i, bits;
+ unsigned int b;
+
+ otp_cache_expire(c);
+
+ x = otp_cache_find(c, otp_key_fingerprint(key), i_seed);
+ if(x == NULL || x->its < g->its) {
+   c->misses++;
+   return 0;
+ }
+
+ /* The first g->its blocks of the pad are its top g->its * k bits. */
+ shift = (size_t)key->k * (x->its - g->its);
+ s = shift / GMP_NUMB_BITS;
+ b = shift % GMP_NUMB_BITS;
+
+ for(i = 0; i < g->nlimbs; i++) {
+   g->pad[i] = x->pad[s + i] >> b;
+   if(b && s + i + 1 < x->nlimbs) g->pad[i] |= x->pad[s + i + 1] << (GMP_NUMB_BITS - b);
+ }
+
+ bits = g->its * key->k;
+ if(bits % GMP_NUMB_BITS) g->pad[g->nlimbs - 1] &= ((mp_limb_t)1 << (bits % GMP_NUMB_BITS)) - 1;
+
+ g->done = g->its;
+
+ otp_cache_unlink(c, x);
+ otp_cache_push(c, x);
+ c->hits++;
+
+ return 1;
+}
+
+/* Add the pad of g - run to completion, but not yet finished - as the pad for i_seed. *
+ * Returns 1 if it was refused, 0 if it's now in the cache.                            */
+static inline int otp_cache_put(otp_cache *c, const otp_key *key, int i_seed, const otp_gen *g) {
+ unsigned long long fp = otp_key_fingerprint(key);
+ otp_cache_entry *x;
+ size_t bytes = g->nlimbs * sizeof(mp_limb_t);
+ void *p;
+
+#ifdef OTPCACHE_POSIX
+ size_t page = (size_t)sysconf(_SC_PAGESIZE);
+ bytes = (bytes + page - 1) / page * page;
+#endif
+
+ otp_cache_expire(c);
+
+ x = otp_cache_find(c, fp, i_seed);
+ if(x != NULL) {
+   if(x->its >= g->its) {
+     otp_cache_unlink(c, x);
+     otp_cache_push(c, x);
+     return 0;
+   }
+   otp_cache_drop(c, x); /* a longer pad replaces it */
+ }
+
+ if(bytes > c->max_bytes) {
+   c->refused++;
+   return 1;
+ }
+
+ while(c->bytes + bytes > c->max_bytes) {
+   otp_cache_drop(c, c->tail);
+   c->evicted++;
+ }
+
+ x = (otp_cache_entry*)calloc(1, sizeof(otp_cache_entry));
+ if(x == NULL) {
+   c->refused++;
+   return 1;
+ }
+
+#ifdef OTPCACHE_POSIX
+ p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+ if(p == MAP_FAILED) p = NULL;
+ else if(mlock(p, bytes)) {
+   munmap(p, bytes);
+   p = NULL;
+ }
+#ifdef MADV_DONTDUMP
+ if(p != NULL) madvise(p, bytes, MADV_DONTDUMP);
+#endif
+#else
+ p = malloc(bytes);
+#endif
+
+ if(p == NULL) {
+   free(x);
+   c->refused++;
+   return 1;
+ }
+
+ x->fp = fp;
+ x->i_seed = i_seed;
+ x->its = g->its;
+ x->nlimbs = g->nlimbs;
+ x->bytes = bytes;
+ x->born = time(NULL);
+ x->pad = (mp_limb_t*)p;
+ memcpy(x->pad, g->pad, g->nlimbs * sizeof(mp_limb_t));
+
+ otp_cache_push(c, x);
+ c->bytes += bytes;
+ c->entries++;
+
+ return 0;
+}
+
+/* Wipe and release every entry. The counters are kept. */
+static inline void otp_cache_clear(otp_cache *c) {
+ while(c->head != NULL) otp_cache_drop(c, c->head);
+}
+
+#endif
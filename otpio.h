@@ -0,0 +1,461 @@
+/*******************************************************************************************
+ * Copyright 2020 sisyphus                                                                 *
+ *                                                                                         *
+ * otpio.h - whole-file reads and writes for encrypt.exe and decrypt.exe.                  *
+ *                                                                                         *
+ * On Linux the files are transferred with io_uring: each file is split into otpio_chunk   *
+ * byte requests, and up to otpio_depth of those (from any of the files in the batch) are  *
+ * kept in flight at once. The caller's buffers are registered with the ring where the     *
+ * kernel allows it, so that READ_FIXED/WRITE_FIXED can skip the per-request page pinning. *
+ * If otpio_direct is set, files are opened with O_DIRECT and the page cache is bypassed   *
+ * (buffers from otpio_alloc() meet the alignment that O_DIRECT needs).                    *
+ *                                                                                         *
+ * Whether io_uring can be used is decided at runtime - if the kernel is too old (before   *
+ * 5.6, which lacks IORING_OP_READ/WRITE), or io_uring has been disabled, or OTPIO_STDIO   *
+ * is selected, plain stdio is used instead.                                               *
+ * (On other systems stdio is all there is.)                                               *
+ *                                                                                         *
+ * Each function prints a message describing any problem and returns non-zero.             *
+ *******************************************************************************************/
+
+#ifndef OTPIO_H
+#define OTPIO_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#ifdef IORING_FEAT_RW_CUR_POS /* IORING_OP_READ and IORING_OP_WRITE arrived alongside this */
+#define OTPIO_URING 1
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+#endif
+#endif
+
+#define OTPIO_CHUNK (1 << 20) /* bytes per read or write request (default) */
+#define OTPIO_DEPTH 32        /* requests kept in flight at once (default)  */
+#define OTPIO_MAX_DEPTH 256
+#define OTPIO_ALIGN 4096      /* buffer/length alignment for O_DIRECT */
+
+#define OTPIO_AUTO  0         /* io_uring if the kernel allows it, else stdio */
+#define OTPIO_STDIO 1         /* always stdio */
+
+static int otpio_mode = OTPIO_AUTO;
+static int otpio_direct = 0;
+static size_t otpio_chunk = OTPIO_CHUNK;    /* a multiple of OTPIO_ALIGN - see otptune.h */
+static unsigned otpio_depth = OTPIO_DEPTH;  /* 1 to OTPIO_MAX_DEPTH                      */
+static const char *otpio_used = "none"; /* backend used by the last transfer */
+
+typedef struct {
+ const char *fname;
+ char *buf;
+ size_t len;    /* bytes to write - or, for a read, bytes expected */
+ int write;
+ int fd;
+ int direct;    /* this file was opened with O_DIRECT */
+ size_t next;   /* offset of the next request to be submitted */
+ size_t done;   /* for reads: end of the data read so far */
+ int eof;
+} otpio_file;
+
+/* A buffer of at least len + 1 bytes that is good for O_DIRECT. Release it with free(). */
+static inline char *otpio_alloc(size_t len) {
+ size_t cap = (len + OTPIO_ALIGN) & ~(size_t)(OTPIO_ALIGN - 1);
+#ifdef OTPIO_URING
+ void *p;
+ if(posix_memalign(&p, OTPIO_ALIGN, cap)) return NULL;
+ return (char*)p;
+#else
+ return (char*)malloc(cap);
+#endif
+}
+
+static inline int otpio_stdio(otpio_file *f, int n) {
+ FILE *fp;
+ size_t ret;
+ int i;
+
+ otpio_used = "stdio";
+
+ for(i = 0; i < n; i++) {
+   fp = fopen(f[i].fname, f[i].write ? "wb" : "rb");
+
+   if(fp == NULL) {
+     printf("Error while opening %s for %s.\n", f[i].fname, f[i].write ? "writing" : "reading");
+     return 1;
+   }
+
+   if(f[i].write) ret = fwrite(f[i].buf, 1, f[i].len, fp);
+   else ret = fread(f[i].buf, 1, f[i].len, fp);
+
+   fclose(fp);
+
+   if(ret != f[i].len) {
+     printf("'%s': %d bytes were %s but %d were expected.\n", f[i].fname, (int)ret,
+            f[i].write ? "written" : "read", (int)f[i].len);
+     return 1;
+   }
+ }
+
+ return 0;
+}
+
+#ifdef OTPIO_URING
+
+typedef struct {
+ int fd;
+ unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+ unsigned *cq_head, *cq_tail, *cq_mask;
+ struct io_uring_sqe *sqes;
+ struct io_uring_cqe *cqes;
+ void *sq_ptr, *cq_ptr;
+ size_t sq_sz, cq_sz, sqes_sz;
+} otpio_ring;
+
+typedef struct {
+ int file;
+ size_t off, len;
+} otpio_req;
+
+static inline void otpio_ring_exit(otpio_ring *r) {
+ munmap(r->sqes, r->sqes_sz);
+ if(r->cq_ptr != r->sq_ptr) munmap(r->cq_ptr, r->cq_sz);
+ munmap(r->sq_ptr, r->sq_sz);
+ close(r->fd);
+}
+
+static inline int otpio_ring_init(otpio_ring *r, unsigned entries) {
+ struct io_uring_params p;
+
+ memset(&p, 0, sizeof(p));
+ r->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+ if(r->fd < 0) return 1;
+
+ /* Headers with IORING_OP_READ/WRITE don't mean the kernel has them - one before 5.6 *
+  * sets up the ring, then fails every request. Leave that kernel to stdio.          */
+ if(!(p.features & IORING_FEAT_RW_CUR_POS)) {
+   close(r->fd);
+   return 1;
+ }
+
+ r->sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+ r->cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+ if(p.features & IORING_FEAT_SINGLE_MMAP) {
+   if(r->cq_sz > r->sq_sz) r->sq_sz = r->cq_sz;
+   r->cq_sz = r->sq_sz;
+ }
+
+ r->sq_ptr = mmap(NULL, r->sq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+ if(r->sq_ptr == MAP_FAILED) {
+   close(r->fd);
+   return 1;
+ }
+
+ if(p.features & IORING_FEAT_SINGLE_MMAP) r->cq_ptr = r->sq_ptr;
+ else {
+   r->cq_ptr = mmap(NULL, r->cq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+   if(r->cq_ptr == MAP_FAILED) {
+     munmap(r->sq_ptr, r->sq_sz);
+     close(r->fd);
+     return 1;
+   }
+ }
+
+ r->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+ r->sqes = (struct io_uring_sqe*)mmap(NULL, r->sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                      r->fd, IORING_OFF_SQES);
+ if(r->sqes == MAP_FAILED) {
+   if(r->cq_ptr != r->sq_ptr) munmap(r->cq_ptr, r->cq_sz);
+   munmap(r->sq_ptr, r->sq_sz);
+   close(r->fd);
+   return 1;
+ }
+
+ r->sq_head  = (unsigned*)((char*)r->sq_ptr + p.sq_off.head);
+ r->sq_tail  = (unsigned*)((char*)r->sq_ptr + p.sq_off.tail);
+ r->sq_mask  = (unsigned*)((char*)r->sq_ptr + p.sq_off.ring_mask);
+ r->sq_array = (unsigned*)((char*)r->sq_ptr + p.sq_off.array);
+ r->cq_head  = (unsigned*)((char*)r->cq_ptr + p.cq_off.head);
+ r->cq_tail  = (unsigned*)((char*)r->cq_ptr + p.cq_off.tail);
+ r->cq_mask  = (unsigned*)((char*)r->cq_ptr + p.cq_off.ring_mask);
+ r->cqes     = (struct io_uring_cqe*)((char*)r->cq_ptr + p.cq_off.cqes);
+
+ return 0;
+}
+
+/* Queue a read or write of f->buf[off .. off+len) as request slot s. */
+static inline void otpio_prep(otpio_ring *r, otpio_file *f, int file, otpio_req *req, int s,
+                              size_t off, size_t len, int fixed) {
+ unsigned tail = *r->sq_tail, idx = tail & *r->sq_mask;
+ struct io_uring_sqe *sqe = &r->sqes[idx];
+
+ memset(sqe, 0, sizeof(*sqe));
+ if(fixed) {
+   sqe->opcode = f->write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+   sqe->buf_index = (unsigned short)file;
+ }
+ else sqe->opcode = f->write ? IORING_OP_WRITE : IORING_OP_READ;
+ sqe->fd = f->fd;
+ sqe->off = off;
+ sqe->addr = (uintptr_t)(f->buf + off);
+ sqe->len = (unsigned)len;
+ sqe->user_data = (unsigned long long)s;
+
+ req[s].file = file;
+ req[s].off = off;
+ req[s].len = len;
+
+ r->sq_array[idx] = idx;
+ __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* Returns -1 if io_uring isn't available (nothing has been touched), *
+ * 1 if the transfer failed, 0 on success.                            */
+static inline int otpio_uring(otpio_file *f, int n) {
+ otpio_ring r;
+ otpio_req req[OTPIO_MAX_DEPTH];
+ int free_slot[OTPIO_MAX_DEPTH], nfree, i, s, fixed, ret = 0;
+ unsigned inflight = 0, submit = 0, head;
+ struct io_uring_cqe *cqe;
+ struct iovec *iov;
+ size_t len, alen;
+ int cur = 0;
+
+ unsigned depth = otpio_depth < 1 ? 1 : otpio_depth > OTPIO_MAX_DEPTH ? OTPIO_MAX_DEPTH : otpio_depth;
+ size_t chunk = otpio_chunk < OTPIO_ALIGN ? OTPIO_ALIGN : otpio_chunk & ~(size_t)(OTPIO_ALIGN - 1);
+
+ if(otpio_ring_init(&r, depth)) return -1;
+
+ otpio_used = "io_uring";
+
+ for(i = 0; i < n; i++) {
+   f[i].fd = -1;
+   f[i].next = f[i].done = 0;
+   f[i].eof = 0;
+   f[i].direct = 0;
+ }
+
+ for(i = 0; i < n; i++) {
+   int flags = f[i].write ? O_WRONLY | O_CREAT | O_TRUNC : O_RDONLY;
+
+#ifdef O_DIRECT
+   if(otpio_direct && !((uintptr_t)f[i].buf & (OTPIO_ALIGN - 1))) {
+     f[i].fd = open(f[i].fname, flags | O_DIRECT, 0644);
+     if(f[i].fd >= 0) f[i].direct = 1;   /* else the filesystem may not support it */
+   }
+#endif
+   if(f[i].fd < 0) f[i].fd = open(f[i].fname, flags, 0644);
+
+   if(f[i].fd < 0) {
+     printf("Error while opening %s for %s.\n", f[i].fname, f[i].write ? "writing" : "reading");
+     ret = 1;
+     goto done;
+   }
+ }
+
+ /* Register every buffer (each as a single iovec). If the kernel won't pin that much *
+  * memory for us, the plain READ/WRITE opcodes do the same job a little less cheaply. */
+ iov = (struct iovec*)malloc(n * sizeof(struct iovec));
+ fixed = 0;
+ if(iov != NULL) {
+   for(i = 0; i < n; i++) {
+     iov[i].iov_base = f[i].buf;
+     iov[i].iov_len = f[i].direct ? (f[i].len + OTPIO_ALIGN - 1) & ~(size_t)(OTPIO_ALIGN - 1) : f[i].len;
+     if(iov[i].iov_len == 0) iov[i].iov_len = 1;
+   }
+   fixed = n <= 65535 && !syscall(__NR_io_uring_register, r.fd, IORING_REGISTER_BUFFERS, iov, n);
+   free(iov);
+ }
+
+ for(nfree = 0; nfree < (int)depth; nfree++)
+   free_slot[nfree] = nfree;
+
+ while(1) {
+   /* Fill the submission queue, taking the next chunk of each file in turn. */
+   for(i = 0; i < n && nfree; i++, cur = (cur + 1) % n) {
+     otpio_file *g = &f[cur];
+
+     if(g->eof || g->next >= g->len) continue;
+
+     len = g->len - g->next < chunk ? g->len - g->next : chunk;
+     alen = len;
+     if(g->direct && !g->write) alen = (len + OTPIO_ALIGN - 1) & ~(size_t)(OTPIO_ALIGN - 1);
+     if(g->direct && g->write && (len & (OTPIO_ALIGN - 1))) {
+       /* O_DIRECT can't write the unaligned tail - wait for everything else, then *
+        * switch the file back to buffered writes for the remainder.               */
+       if(inflight) continue;
+#ifdef O_DIRECT
+       fcntl(g->fd, F_SETFL, fcntl(g->fd, F_GETFL) & ~O_DIRECT);
+#endif
+       g->direct = 0;
+     }
+
+     s = free_slot[--nfree];
+     otpio_prep(&r, g, cur, req, s, g->next, alen, fixed);
+     g->next += len;
+     inflight++;
+     submit++;
+     i = -1; /* rescan until the ring is full or there's nothing left */
+     if(!nfree) break;
+   }
+
+   if(!inflight) break;
+
+   if(syscall(__NR_io_uring_enter, r.fd, submit, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+     if(errno == EINTR) continue;
+     printf("io_uring_enter failed: %s\n", strerror(errno));
+     ret = 1;
+     break;
+   }
+   submit = 0;
+
+   head = *r.cq_head;
+   while(head != __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE)) {
+     cqe = &r.cqes[head & *r.cq_mask];
+     s = (int)cqe->user_data;
+     otpio_file *g = &f[req[s].file];
+
+     if(cqe->res == -EAGAIN || cqe->res == -EINTR) {
+       otpio_prep(&r, g, req[s].file, req, s, req[s].off, req[s].len, fixed);
+       submit++;
+     }
+     else if(cqe->res < 0) {
+       printf("'%s': %s failed: %s\n", g->fname, g->write ? "write" : "read", strerror(-cqe->res));
+       ret = 1;
+       free_slot[nfree++] = s;
+       inflight--;
+     }
+     else if(!g->write && (size_t)cqe->res < req[s].len) {
+       if(cqe->res == 0 || g->direct) {            /* end of file */
+         if(req[s].off + cqe->res > g->done) g->done = req[s].off + cqe->res;
+         g->eof = 1;
+         free_slot[nfree++] = s;
+         inflight--;
+       }
+       else {                                        /* plain short read - ask for the rest */
+         otpio_prep(&r, g, req[s].file, req, s, req[s].off + cqe->res, req[s].len - cqe->res, fixed);
+         submit++;
+       }
+     }
+     else if(g->write && (size_t)cqe->res < req[s].len) {
+       printf("'%s': only %d of %d bytes were written.\n", g->fname, (int)cqe->res, (int)req[s].len);
+       ret = 1;
+       free_slot[nfree++] = s;
+       inflight--;
+     }
+     else {
+       if(!g->write && req[s].off + req[s].len > g->done) g->done = req[s].off + req[s].len;
+       free_slot[nfree++] = s;
+       inflight--;
+     }
+
+     head++;
+   }
+   __atomic_store_n(r.cq_head, head, __ATOMIC_RELEASE);
+
+   if(ret && !inflight) break;
+   if(ret) { /* stop queueing new work, but let what's in flight drain */
+     for(i = 0; i < n; i++)
+       f[i].next = f[i].len;
+   }
+ }
+
+ for(i = 0; i < n && !ret; i++) {
+   if(!f[i].write && (f[i].done < f[i].len ? f[i].done : f[i].len) != f[i].len) {
+     printf("'%s' contains %d bytes but %d were expected.\n", f[i].fname, (int)f[i].done, (int)f[i].len);
+     ret = 1;
+   }
+ }
+
+ done:
+ for(i = 0; i < n; i++) {
+   if(f[i].fd >= 0) close(f[i].fd);
+ }
+ otpio_ring_exit(&r);
+ return ret;
+}
+
+#endif
+
+/* Read or write (as each element's write field says) all n files. */
+static inline int otpio_transfer(otpio_file *f, int n) {
+#ifdef OTPIO_URING
+ int ret;
+
+ if(otpio_mode != OTPIO_STDIO) {
+   ret = otpio_uring(f, n);
+   if(ret >= 0) return ret;
+ }
+#endif
+ return otpio_stdio(f, n);
+}
+
+/* Set *len to the size of fname, refusing files of more than max bytes. */
+static inline int otpio_size(const char *fname, size_t *len, size_t max) {
+ struct stat stbuf;
+
+ if(stat(fname, &stbuf)) {
+   printf("Unable to stat %s: %s\n", fname, strerror(errno));
+   return 1;
+ }
+
+ if((unsigned long long)stbuf.st_size > max) {
+   printf("This program cannot reliably deal with an '%s' whose size is greater than %llu bytes.\n",
+          fname, (unsigned long long)max);
+   return 1;
+ }
+
+ *len = (size_t)stbuf.st_size;
+ return 0;
+}
+
+/* Read the whole of fname (of at most max bytes) into a buffer from otpio_alloc(), *
+ * which is NULL terminated for the benefit of the string checks in the callers.    */
+static inline int otpio_read(const char *fname, char **buf, size_t *len, size_t max) {
+ otpio_file f;
+
+ if(otpio_size(fname, len, max)) return 1;
+
+ *buf = otpio_alloc(*len);
+ if(*buf == NULL) {
+   printf("Failed to allocate memory to read %s.\n", fname);
+   return 1;
+ }
+
+ memset(&f, 0, sizeof(f));
+ f.fname = fname;
+ f.buf = *buf;
+ f.len = *len;
+
+ if(otpio_transfer(&f, 1)) {
+   free(*buf);
+   return 1;
+ }
+
+ (*buf)[*len] = 0;
+ return 0;
+}
+
+static inline int otpio_write(const char *fname, const char *buf, size_t len) {
+ otpio_file f;
+
+ memset(&f, 0, sizeof(f));
+ f.fname = fname;
+ f.buf = (char*)buf;
+ f.len = len;
+ f.write = 1;
+
+ return otpio_transfer(&f, 1);
+}
+
+#endif
@@ -0,0 +1,450 @@
+/*******************************************************************************************
+ * Copyright 2020 sisyphus                                                                 *
+ *                                                                                         *
+ * otpjournal.h - checkpoints for "encrypt.exe JOURNAL" and "decrypt.exe JOURNAL", so that *
+ * a long run that's killed (or whose machine is taken away, or whose disk fills up) can   *
+ * be resumed by running the same command again, rather than from the first step.         *
+ *                                                                                         *
+ * Every so often (OTP_JOURNAL_SECS seconds, by default) the bytes of output that the pad  *
+ * generated so far determines are written to the output file - "msg.enc", with its        *
+ * header, or "msg.dec" - and fsync'd. The journal is then replaced (atomically, as in     *
+ * otpstate.h) by a record of how far the generator has got and a hash of what has been    *
+ * written. A failed checkpoint is reported, and the previous one stands.                  *
+ *                                                                                         *
+ * On resuming, the journal is checked against "primes.in" and the input, the bytes that  *
+ * were written are read back and checked against the hash, and the pad behind them is     *
+ * recovered (it's the output XOR the input) - so the generator carries on from its saved  *
+ * seed. Once the rest of the output has been written the journal is removed.              *
+ *                                                                                         *
+ * The journal holds the generator's seed, which is as secret as "primes.in", so it's      *
+ * created with mode 0600. It's a short text file:                                         *
+ *                                                                                         *
+ *  otpjournal 2                                                                           *
+ *  key N e fp                   - checked against "primes.in": fp is the fingerprint of   *
+ *                                 phi (otp_key_fingerprint()), as keys of one size share  *
+ *                                 N and e - a journal from before a key rotation is       *
+ *                                 refused                                                 *
+ *  seed i_seed                  - as in the header of msg.enc                             *
+ *  flags f                      - as in the header of msg.enc                             *
+ *  in len hash                  - the bytes being XOR'd with the pad, and their hash      *
+ *  steps done                   - generator steps done                                    *
+ *  out hlen strip bytes hash    - the output so far: header length, leading zero bytes    *
+ *                                 (which mpz_export drops), bytes determined (counting    *
+ *                                 those zeros) and the hash of what's in the file         *
+ *  rest bits hex                - output bits determined beyond those bytes               *
+ *  state hex                    - the seed that the generator continues from              *
+ *                                                                                         *
+ * Only the MicaliSchnorr pad is journalled - there's nothing to gain in HYBRID mode, where *
+ * it's a single step. While a COMPRESSED message is being decrypted, "msg.dec" holds the  *
+ * decrypted but still compressed bytes; they're replaced by the message at the end.       *
+ *                                                                                         *
+ * Each function prints a message describing any problem and returns non-zero.             *
+ *******************************************************************************************/
+
+#ifndef OTPJOURNAL_H
+#define OTPJOURNAL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <gmp.h>
+#include "otp.h"
+#include "otpmsg.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#define OTPJOURNAL_POSIX 1
+#endif
+
+#define OTP_JOURNAL_SECS  60 /* default seconds between checkpoints        */
+#define OTP_JOURNAL_CHECK 64 /* generator steps between looks at the clock */
+
+#define OTP_FNV_INIT 14695981039346656037ULL
+
+typedef struct {
+ const char *fname, *out_name;
+ int header;        /* out_name is a msg.enc, with a (padded) header */
+ int secs, loaded;
+ unsigned int N, e;
+ unsigned long long fp;
+ int i_seed, flags;
+ size_t in_len, done, hlen, strip, committed, rest_bits;
+ unsigned long long in_hash, out_hash;
+ mpz_t z_rest, z_seed;
+} otp_journal;
+
+/* 64 bit FNV-1a, continued from h over len bytes. */
+static inline unsigned long long otp_journal_hash(unsigned long long h, const char *buf, size_t len) {
+ size_t i;
+
+ for(i = 0; i < len; i++) {
+   h ^= (unsigned char)buf[i];
+   h *= 1099511628211ULL;
+ }
+
+ return h;
+}
+
+static inline void otp_journal_init(otp_journal *j, const char *fname, const char *out_name, int header, int secs) {
+ memset(j, 0, sizeof(*j));
+ j->fname = fname;
+ j->out_name = out_name;
+ j->header = header;
+ j->secs = secs;
+ mpz_init(j->z_rest);
+ mpz_init(j->z_seed);
+}
+
+static inline void otp_journal_clear(otp_journal *j) {
+ mpz_clear(j->z_rest);
+ mpz_clear(j->z_seed);
+}
+
+/* Read j->fname into j. Returns -1, quietly, if there is no journal. */
+static inline int otp_journal_load(otp_journal *j) {
+ FILE *fp;
+ char tag[16];
+ unsigned long long in_len, done, hlen, strip, committed, rest_bits;
+ int version, ok;
+
+ fp = fopen(j->fname, "r");
+
+ if(fp == NULL) {
+   if(errno == ENOENT) return -1;
+   printf("Error while opening %s for reading.\n", j->fname);
+   return 1;
+ }
+
+ ok = fscanf(fp, "%15s %d", tag, &version) == 2 && !strcmp(tag, "otpjournal") && version == 2
+   && fscanf(fp, " key %u %u %llx", &j->N, &j->e, &j->fp) == 3
+   && fscanf(fp, " seed %d", &j->i_seed) == 1
+   && fscanf(fp, " flags %d", &j->flags) == 1
+   && fscanf(fp, " in %llu %llx", &in_len, &j->in_hash) == 2
+   && fscanf(fp, " steps %llu", &done) == 1
+   && fscanf(fp, " out %llu %llu %llu %llx", &hlen, &strip, &committed, &j->out_hash) == 4
+   && fscanf(fp, " rest %llu", &rest_bits) == 1
+   && gmp_fscanf(fp, " %Zx", j->z_rest) == 1
+   && gmp_fscanf(fp, " state %Zx", j->z_seed) == 1;
+
+ fclose(fp);
+
+ if(!ok) {
+   printf("%s is not a valid journal.\n", j->fname);
+   return 1;
+ }
+
+ j->in_len = (size_t)in_len;
+ j->done = (size_t)done;
+ j->hlen = (size_t)hlen;
+ j->strip = (size_t)strip;
+ j->committed = (size_t)committed;
+ j->rest_bits = (size_t)rest_bits;
+ j->loaded = 1;
+
+ return 0;
+}
+
+/* Replace j->fname with the contents of j. */
+static inline int otp_journal_save(const otp_journal *j) {
+ FILE *fp;
+ char *tmp_name;
+ int ret;
+
+ tmp_name = (char*)malloc(strlen(j->fname) + 5);
+ if(tmp_name == NULL) {
+   printf("Failed to allocate memory to journal file name.\n");
+   return 1;
+ }
+ sprintf(tmp_name, "%s.tmp", j->fname);
+
+#ifdef OTPJOURNAL_POSIX
+ {
+   int fd = open(tmp_name, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+   fp = fd < 0 ? NULL : fdopen(fd, "w");
+   if(fp == NULL && fd >= 0) close(fd);
+ }
+#else
+ fp = fopen(tmp_name, "w");
+#endif
+
+ if(fp == NULL) {
+   printf("Error while opening %s for writing.\n", tmp_name);
+   free(tmp_name);
+   return 1;
+ }
+
+ fprintf(fp, "otpjournal 2\nkey %u %u %016llx\nseed %d\nflags %d\n", j->N, j->e, j->fp, j->i_seed, j->flags);
+ fprintf(fp, "in %llu %016llx\nsteps %llu\nout %llu %llu %llu %016llx\n",
+         (unsigned long long)j->in_len, j->in_hash, (unsigned long long)j->done, (unsigned long long)j->hlen,
+         (unsigned long long)j->strip, (unsigned long long)j->committed, j->out_hash);
+ gmp_fprintf(fp, "rest %llu %Zx\nstate %Zx\n", (unsigned long long)j->rest_bits, j->z_rest, j->z_seed);
+
+ ret = fflush(fp) != 0;
+#ifdef OTPJOURNAL_POSIX
+ if(!ret) ret = fsync(fileno(fp)) != 0;
+#endif
+ if(fclose(fp)) ret = 1;
+
+ if(!ret && rename(tmp_name, j->fname)) ret = 1;
+
+ if(ret) {
+   printf("Failed to write %s.\n", j->fname);
+   remove(tmp_name);
+ }
+
+ free(tmp_name);
+ return ret;
+}
+
+/* After otp_enc_begin() or otp_dec_begin(): for a new journal, record what m is. For one *
+ * that was loaded, check that it belongs to m, read back and check the output written    *
+ * so far, and take m->gen on to the checkpoint.                                          */
+static inline int otp_journal_start(const otp_key *key, otp_journal *j, otp_msg *m) {
+ otp_gen *g = &m->gen;
+ size_t len = j->header ? m->msg_len : (size_t)m->i_count;
+ size_t width = (g->bitsize + 7) / 8, bits, olen;
+ unsigned long long h = otp_journal_hash(OTP_FNV_INIT, m->msg_buf, len);
+ char *buf = NULL, hdr[48];
+ FILE *fp;
+ mpz_t z_v, z_t;
+ int ret = 1;
+
+ if(!j->loaded) {
+   j->N = key->N;
+   j->e = key->e;
+   j->fp = otp_key_fingerprint(key);
+   j->i_seed = m->i_seed;
+   j->flags = m->flags;
+   j->in_len = len;
+   j->in_hash = h;
+   j->out_hash = OTP_FNV_INIT;
+   return 0;
+ }
+
+ /* Nothing is recovered from a journal that was written under another key. */
+ if(j->N != key->N || j->e != key->e || j->fp != otp_key_fingerprint(key)) {
+   printf("%s was written for a different primes.in - delete it to start again.\n", j->fname);
+   return 1;
+ }
+
+ if(j->i_seed != m->i_seed || j->flags != m->flags ||
+    j->in_len != len || j->in_hash != h) {
+   printf("%s does not belong to this message - delete it to start again.\n", j->fname);
+   return 1;
+ }
+
+ /* The output has 8 * width - bitsize leading zero bits, then the pad's done * k bits. */
+ bits = 8 * width - g->bitsize + j->done * key->k;
+
+ if(j->done < 1 || j->done >= g->its || j->committed > width || (j->committed && j->strip >= j->committed) ||
+    8 * j->committed + j->rest_bits != bits || mpz_sizeinbase(j->z_seed, 2) > key->r) {
+   printf("%s is not a valid journal.\n", j->fname);
+   return 1;
+ }
+
+ mpz_init(z_v);
+ mpz_init(z_t);
+
+ olen = j->committed ? j->hlen + j->committed - j->strip : 0;
+
+ if(olen) {
+   buf = (char*)malloc(olen);
+   fp = fopen(j->out_name, "rb");
+
+   if(buf == NULL || fp == NULL || fread(buf, 1, olen, fp) != olen) {
+     printf("Unable to read back the %llu bytes of %s written before the checkpoint.\n",
+            (unsigned long long)olen, j->out_name);
+     if(fp != NULL) fclose(fp);
+     goto done;
+   }
+
+   fclose(fp);
+
+   if(j->header) {
+     m->i_count = (int)(width - j->strip);
+     if(otp_msg_header(hdr, m, 1) != j->hlen || memcmp(hdr, buf, j->hlen)) olen = 0;
+   }
+
+   if(!olen || otp_journal_hash(OTP_FNV_INIT, buf, olen) != j->out_hash) {
+     printf("%s no longer matches %s - delete %s to start again.\n", j->out_name, j->fname, j->fname);
+     goto done;
+   }
+
+   mpz_import(z_v, olen - j->hlen, 1, 1, 0, 0, buf + j->hlen);
+ }
+
+ mpz_mul_2exp(z_v, z_v, j->rest_bits);
+ mpz_ior(z_v, z_v, j->z_rest);
+
+ /* The pad so far is the output XOR the top done * k bits of the input. */
+ mpz_fdiv_q_2exp(z_t, m->z_msg, g->bitsize - j->done * key->k);
+ mpz_xor(z_v, z_v, z_t);
+
+ if(mpz_sizeinbase(z_v, 2) > j->done * key->k) {
+   printf("%s is not a valid journal.\n", j->fname);
+   goto done;
+ }
+
+ mpz_mul_2exp(z_v, z_v, (g->its - j->done) * key->k);
+ memcpy(g->pad, mpz_limbs_read(z_v), mpz_size(z_v) * sizeof(mp_limb_t));
+ mpz_set(g->z_seed, j->z_seed);
+ g->done = j->done;
+
+ printf("resuming from step %llu of %llu (%llu bytes of %s already written)\n", (unsigned long long)g->done,
+        (unsigned long long)g->its, (unsigned long long)olen, j->out_name);
+ ret = 0;
+
+ done:
+ free(buf);
+ mpz_clear(z_v);
+ mpz_clear(z_t);
+ return ret;
+}
+
+/* Write whatever more of the output the pad generated so far determines, and save the journal. */
+static inline int otp_journal_checkpoint(const otp_key *key, otp_journal *j, otp_msg *m) {
+ otp_gen *g = &m->gen;
+ size_t width = (g->bitsize + 7) / 8, bits, bytes, from, off, hlen = j->hlen, strip = j->strip;
+ unsigned long long h = j->out_hash;
+ char *buf, hdr[48];
+ FILE *fp = NULL;
+ mpz_t z_raw, z_v, z_t;
+ int ret = 0;
+
+ bits = 8 * width - g->bitsize + g->done * key->k;
+ bytes = bits / 8;
+
+ buf = (char*)malloc(1 + bytes);
+ if(buf == NULL) {
+   printf("Failed to allocate memory to checkpoint buffer.\n");
+   return 1;
+ }
+
+ mpz_init(z_v);
+ mpz_init(z_t);
+
+ mpz_fdiv_q_2exp(z_v, mpz_roinit_n(z_raw, g->pad, g->nlimbs), (g->its - g->done) * key->k);
+ mpz_fdiv_q_2exp(z_t, m->z_msg, g->bitsize - g->done * key->k);
+ mpz_xor(z_v, z_v, z_t);
+
+ mpz_fdiv_q_2exp(z_t, z_v, bits - 8 * bytes);
+ otp_export((unsigned char*)buf, bytes, z_t);
+
+ /* Nothing can be written until the first non-zero byte fixes the header's count. */
+ if(!j->committed) {
+   for(strip = 0; strip < bytes && !buf[strip]; strip++);
+
+   if(strip == bytes) bytes = strip = 0;
+   else if(j->header) {
+     m->i_count = (int)(width - strip);
+     hlen = otp_msg_header(hdr, m, 1);
+   }
+ }
+
+ if(bytes > j->committed) {
+   from = j->committed ? j->committed : strip;
+   off = j->committed ? j->hlen + j->committed - j->strip : 0;
+
+   fp = fopen(j->out_name, j->committed ? "r+b" : "wb");
+   ret = fp == NULL || fseek(fp, (long)off, SEEK_SET);
+
+   if(!ret && !j->committed && hlen) {
+     ret = fwrite(hdr, 1, hlen, fp) != hlen;
+     h = otp_journal_hash(OTP_FNV_INIT, hdr, hlen);
+   }
+
+   if(!ret) ret = fwrite(buf + from, 1, bytes - from, fp) != bytes - from || fflush(fp) != 0;
+#ifdef OTPJOURNAL_POSIX
+   if(!ret) ret = fsync(fileno(fp)) != 0;
+#endif
+   if(fp != NULL && fclose(fp)) ret = 1;
+
+   if(ret) printf("Unable to write a checkpoint to %s - carrying on from the last one.\n", j->out_name);
+   else h = otp_journal_hash(h, buf + from, bytes - from);
+ }
+ else bytes = j->committed;
+
+ if(!ret) {
+   j->hlen = hlen;
+   j->strip = strip;
+   j->committed = bytes;
+   j->out_hash = h;
+   j->rest_bits = bits - 8 * bytes;
+   mpz_fdiv_r_2exp(j->z_rest, z_v, j->rest_bits);
+   mpz_set(j->z_seed, g->z_seed);
+   j->done = g->done;
+   ret = otp_journal_save(j);
+ }
+
+ free(buf);
+ mpz_clear(z_v);
+ mpz_clear(z_t);
+ return ret;
+}
+
+/* Run m->gen to the end, with a checkpoint every j->secs seconds. */
+static inline void otp_journal_run(const otp_key *key, otp_journal *j, otp_msg *m) {
+ otp_gen *g = &m->gen;
+ time_t last = time(NULL), now;
+
+ while(g->done < g->its) {
+   otp_gen_step(key, g);
+
+   if(g->done % OTP_JOURNAL_CHECK || g->done == g->its) continue;
+
+   now = time(NULL);
+   if(now - last < j->secs) continue;
+
+   otp_journal_checkpoint(key, j, m);
+   last = now;
+ }
+}
+
+/* Write the rest of the output (all len bytes of which are at buf) and remove the journal. */
+static inline int otp_journal_end(otp_journal *j, const char *buf, size_t len) {
+ FILE *fp;
+ size_t off = 0;
+ int ret;
+
+ /* A decompressed message doesn't continue what was written before, so it replaces it *
+  * - once the journal is gone, since it would no longer match.                        */
+ if(!j->header && (j->flags & OTP_COMPRESSED)) {
+   if(remove(j->fname) && errno != ENOENT) {
+     printf("Unable to remove %s.\n", j->fname);
+     return 1;
+   }
+   j->committed = 0;
+ }
+
+ if(j->committed) {
+   off = j->hlen + j->committed - j->strip;
+   if(off > len || otp_journal_hash(OTP_FNV_INIT, buf, off) != j->out_hash) {
+     printf("The output does not agree with what was written to %s before the checkpoint.\n", j->out_name);
+     return 1;
+   }
+ }
+
+ fp = fopen(j->out_name, off ? "r+b" : "wb");
+ ret = fp == NULL || fseek(fp, (long)off, SEEK_SET) || fwrite(buf + off, 1, len - off, fp) != len - off || fflush(fp) != 0;
+#ifdef OTPJOURNAL_POSIX
+ if(!ret) ret = fsync(fileno(fp)) != 0;
+#endif
+ if(fp != NULL && fclose(fp)) ret = 1;
+
+ if(ret) {
+   printf("Failed to write %s.\n", j->out_name);
+   return 1;
+ }
+
+ if(remove(j->fname) && errno != ENOENT) {
+   printf("Unable to remove %s.\n", j->fname);
+   return 1;
+ }
+
+ return 0;
+}
+
+#endif
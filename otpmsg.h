@@ -0,0 +1,516 @@
+/*******************************************************************************************
+ * Copyright 2020 sisyphus                                                                 *
+ *                                                                                         *
+ * otpmsg.h - the steps that take one message through encryption or decryption, shared by *
+ * encrypt.c, decrypt.c and the C++ interface in otpasync.hpp:                             *
+ *                                                                                         *
+ *  encrypt: otp_msg_compress() (optional), otp_enc_begin(), run m->gen, otp_enc_end(),    *
+ *           otp_msg_header()                                                              *
+ *  decrypt: otp_msg_parse(), otp_dec_begin(), run m->gen, otp_dec_end()                   *
+ *                                                                                         *
+ * Running the generator (m->gen, see otp.h) is left to the caller, so that it can be done *
+ * in whatever way suits - msmb_run() for a batch, or a step at a time.                    *
+ *                                                                                         *
+ * Each function prints a message describing any problem and returns non-zero. With       *
+ * m->debug set they also print the same DEBUG output that encrypt.exe and decrypt.exe     *
+ * always have.                                                                            *
+ *******************************************************************************************/
+
+#ifndef OTPMSG_H
+#define OTPMSG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <gmp.h>
+#include "otp.h"
+#include "otpz.h"
+#include "chacha20.h"
+
+typedef struct {
+ int i_seed, i_count, i_bitsize, flags, debug;
+ char *file_buf;     /* owned: the message read in (encrypt) or the whole of msg.enc (decrypt) */
+ char *msg_buf;      /* the bytes to be XOR'd - within file_buf                               */
+ size_t msg_len;
+ char *chk_buf, *dec_buf, *z_buf;   /* owned work buffers                                      */
+ char *out_buf;      /* the result: encrypted bytes, or the decrypted message                   */
+ size_t out_len;
+ int have_z, have_gen;
+ mpz_t z_msg;        /* the message as a number, except in hybrid mode                          */
+ otp_gen gen;
+} otp_msg;
+
+/* Start m off with file_buf (len bytes, from malloc() or otpio_alloc()) which it takes over. */
+static inline void otp_msg_init(otp_msg *m, char *file_buf, size_t len) {
+ memset(m, 0, sizeof(*m));
+ m->file_buf = m->msg_buf = file_buf;
+ m->msg_len = len;
+}
+
+static inline void otp_msg_clear(otp_msg *m) {
+ if(m->have_z) mpz_clear(m->z_msg);
+ if(m->have_gen) otp_gen_clear(&m->gen);
+ free(m->file_buf);
+ free(m->chk_buf);
+ free(m->dec_buf);
+ free(m->z_buf);
+ memset(m, 0, sizeof(*m));
+}
+
+/* Take n consecutive seeds from fname (next_seed.txt), setting *i_seed to the first. */
+static inline int otp_next_seed(const char *fname, int n, int userid, int *i_seed) {
+ FILE *fp;
+ char seed_buf[12];
+
+ fp = fopen(fname, "r");
+
+ if(fp == NULL) {
+   printf("Error while opening %s for reading.\n", fname);
+   return 1;
+ }
+
+ if(fgets (seed_buf, 11, fp)==NULL) {
+   printf("Error while reading %s.\n", fname);
+   fclose(fp);
+   return 1;
+ }
+
+ fclose(fp);
+
+ *i_seed = atoi(seed_buf);
+
+ if(*i_seed < 0 || *i_seed > 999999) {
+   printf("Value read (%d) from %s needs to be in range 0 to 999999 (inclusive).\n", *i_seed, fname);
+   return 1;
+ }
+
+ if(*i_seed + n - 1 > 999999) {
+   printf("%s (%d) leaves too few seeds for %d messages - new primes are needed.\n", fname, *i_seed, n);
+   return 1;
+ }
+
+ *i_seed += userid;
+
+ if(*i_seed < 1000000000 || *i_seed >= 2000000000) {
+   printf("The seed (%d) should now be in the range 1,000,000,000 to 1,999,999,999 (inclusive).\n", *i_seed);
+   return 1;
+ }
+
+ fp = fopen(fname, "w");
+
+ if(fp == NULL) {
+   printf("Error while opening %s for writing.\n", fname);
+   return 1;
+ }
+
+ sprintf(seed_buf, "%d", *i_seed - userid + n);
+ fputs(seed_buf, fp);
+
+ if(fclose(fp)) {
+   printf("Error while writing %s.\n", fname);
+   return 1;
+ }
+
+ return 0;
+}
+
+/* Compress the message, keeping the result (and setting OTP_COMPRESSED) only if it's  *
+ * smaller - or regardless, if force is set.                                            */
+static inline int otp_msg_compress(otp_msg *m, int force) {
+ char *z_buf;
+ size_t count;
+
+ z_buf = (char*)malloc(1 + otpz_bound(m->msg_len));
+ if(z_buf == NULL) {
+   printf("Failed to allocate memory to compression buffer.\n");
+   return 1;
+ }
+
+ count = otpz_compress((unsigned char*)m->msg_buf, m->msg_len, (unsigned char*)z_buf);
+
+ if(count < m->msg_len || force) {
+   free(m->file_buf);
+   m->file_buf = m->msg_buf = z_buf;
+   m->msg_len = count;
+   m->msg_buf[m->msg_len] = 0;
+   m->flags |= OTP_COMPRESSED;
+ }
+ else free(z_buf);
+
+ return 0;
+}
+
+/* Check the message and start m->gen from z_seed, for the pad that will encrypt it. *
+ * m->i_seed and the OTP_HYBRID flag must already be set.                            */
+static inline int otp_enc_begin(const otp_key *key, otp_msg *m, const mpz_t z_seed) {
+ size_t bitsize, count, i;
+
+ m->chk_buf = (char*)malloc(1 + m->msg_len);
+ if(m->chk_buf == NULL) {
+   printf("Failed to allocate memory to check string.\n");
+   return 1;
+ }
+
+ if(m->flags & OTP_HYBRID) {
+   m->i_count = (int)m->msg_len;
+   m->i_bitsize = m->i_count * 8;
+   bitsize = 8 * OTP_HYBRID_BYTES;
+ }
+ else {
+   mpz_init(m->z_msg);
+   m->have_z = 1;
+   mpz_import(m->z_msg, m->msg_len, 1, 1, 0, 0, m->msg_buf);
+
+   if(m->debug) {
+     printf("MESSAGE:\n");
+     mpz_out_str(stdout, 16, m->z_msg);
+     printf("\n");
+   }
+
+   bitsize = mpz_sizeinbase(m->z_msg, 2);
+   m->i_bitsize = (int)bitsize;
+
+   mpz_export(m->chk_buf, &count, 1, 1, 0, 0, m->z_msg);
+   m->chk_buf[count] = 0;
+
+   if(strcmp(m->msg_buf, m->chk_buf)) {
+     printf("<%s>\nIS NOT\n<%s>\n", m->msg_buf, m->chk_buf);
+     return 1;
+   }
+
+   for(i = 0; i < count; i++ ) {
+     if(m->msg_buf[i] != m->chk_buf[i]) {
+       printf("byte[%d] differs between msg_buf and chk_buf.\n", (int)i);
+       return 1;
+     }
+   }
+
+   if(m->msg_buf[count] != m->chk_buf[count]) {
+     printf("msg_buf[%d] != chk_buf[%d]\n", (int)count, (int)count);
+     return 1;
+   }
+
+   if(m->msg_buf[count] != 0) {
+     printf("msg_buf[%d] and chk_buf[%d] are not NULL>\n", (int)count, (int)count);
+     return 1;
+   }
+ }
+
+ if(otp_gen_init(key, &m->gen, z_seed, bitsize)) return 1;
+ m->have_gen = 1;
+
+ return 0;
+}
+
+/* With m->gen run to completion, encrypt the message: m->out_buf gets m->out_len  *
+ * encrypted bytes. If z_rest isn't NULL it gets the unused bits (otp_gen_finish). */
+static inline int otp_enc_end(const otp_key *key, otp_msg *m, mpz_t z_rest) {
+ unsigned char hkey[OTP_HYBRID_BYTES];
+ mpz_t z_enc, z_check;
+ size_t count;
+
+ otp_gen_finish(key, &m->gen, z_rest);
+
+ if(m->flags & OTP_HYBRID) {
+
+  /*************************************************************
+   * The pad provides only the ChaCha20 key and nonce, and the *
+   * message bytes are XOR'd with the ChaCha20 keystream in    *
+   * place. Any leading NULL bytes are therefore preserved.    *
+   *************************************************************/
+
+   otp_export(hkey, OTP_HYBRID_BYTES, m->gen.z_pad);
+
+   chacha20_xor(hkey, hkey + 32, 0, (unsigned char*)m->msg_buf, m->msg_len);
+   memset(hkey, 0, sizeof(hkey));
+
+   m->out_buf = m->msg_buf;
+   m->out_len = m->msg_len;
+
+   if(m->debug) printf("ChaCha20 kernel: %s\n", chacha20_kernel_name);
+ }
+ else {
+   if(m->debug) {
+     printf("PAD:\n");
+     mpz_out_str(stdout, 16, m->gen.z_pad);
+     printf("\n");
+   }
+
+   mpz_init(z_enc);
+   mpz_xor(z_enc, m->z_msg, m->gen.z_pad);
+
+   if(m->debug) {
+     printf("bitsize of input message: %d\n", (int)mpz_sizeinbase(m->z_msg, 2));
+     printf("bitsize of pad: %d\n", (int)mpz_sizeinbase(m->gen.z_pad, 2));
+     printf("bitsize of encrypted message: %d\n", (int)mpz_sizeinbase(z_enc, 2));
+     printf("MSG:\n");
+     mpz_out_str(stdout, 16, z_enc);
+     printf("\n");
+   }
+
+   mpz_export(m->chk_buf, &count, 1, 1, 0, 0, z_enc);
+   m->chk_buf[count] = 0;
+
+   mpz_init(z_check);
+   mpz_import(z_check, count, 1, 1, 0, 0, m->chk_buf);
+
+   if(mpz_cmp(z_check, z_enc)) {
+     printf("mpz_export-mpz_import round trip failed.\n");
+     printf("strlen(chk_buf): %d\n", (int)strlen(m->chk_buf));
+     mpz_clear(z_check);
+     mpz_clear(z_enc);
+     return 1;
+   }
+
+   mpz_clear(z_check);
+   mpz_clear(z_enc);
+
+   m->out_buf = m->chk_buf;
+   m->out_len = count;
+ }
+
+ m->i_count = (int)m->out_len;
+ mpz_set_ui(m->gen.z_pad, 0);
+
+ return 0;
+}
+
+/* Write the header of msg.enc for m to hdr (which needs 48 bytes), returning its length. *
+ * If padded is set, the count is written as 10 digits so that it can later be changed  *
+ * in place (see APPEND in encrypt.c).                                                   */
+static inline size_t otp_msg_header(char *hdr, const otp_msg *m, int padded) {
+ char tmp[12];
+
+ sprintf(hdr, "%d", m->i_seed);
+
+ strcat(hdr, "?");
+ sprintf(tmp, padded ? "%010d" : "%d", m->i_count);
+ strcat(hdr, tmp);
+
+ strcat(hdr, "#");
+ sprintf(tmp, "%d", (m->i_count * 8) - m->i_bitsize);
+ strcat(hdr, tmp);
+
+ if(m->flags) {
+   strcat(hdr, "!");
+   sprintf(tmp, "%d", m->flags);
+   strcat(hdr, tmp);
+ }
+
+ strcat(hdr, "*");
+
+ return strlen(hdr);
+}
+
+/* Read the header at the start of m->file_buf (m->msg_len bytes, NULL terminated), *
+ * leaving m->msg_buf at the encrypted bytes. name is used in messages.             */
+static inline int otp_msg_parse(otp_msg *m, const char *name) {
+ char tmp[12];
+ char *msg_buf = m->file_buf;
+ int i;
+
+ tmp[11] = 0;
+
+ if(m->msg_len < 11 || msg_buf[0] != '1' || msg_buf[10] != '?') {
+   strncpy(tmp, msg_buf, 11);
+   printf("Error at beginning of %s:\n<%s>\n", name, tmp);
+   return 1;
+ }
+
+ for(i = 0; msg_buf[i] != '?'; i++)
+   tmp[i] = msg_buf[i];
+
+ tmp[i] = 0;
+ m->i_seed = atoi(tmp);
+
+ msg_buf += i + 1;
+
+ for(i = 0; i < 11 && msg_buf[i] != '#'; i++)
+   tmp[i] = msg_buf[i];
+
+ if(i == 11) {
+   printf("Error in the header of %s.\n", name);
+   return 1;
+ }
+
+ tmp[i] = 0;
+ m->i_count = atoi(tmp);
+
+ msg_buf += i + 1;
+
+ for(i = 0; i < 11 && msg_buf[i] != '*' && msg_buf[i] != '!'; i++)
+   tmp[i] = msg_buf[i];
+
+ if(i == 11) {
+   printf("Error in the header of %s.\n", name);
+   return 1;
+ }
+
+ tmp[i] = 0;
+ m->i_bitsize = (m->i_count * 8) - atoi(tmp);
+
+ m->flags = 0;
+ if(msg_buf[i] == '!') {
+   msg_buf += i + 1;
+
+   for(i = 0; i < 11 && msg_buf[i] != '*'; i++)
+     tmp[i] = msg_buf[i];
+
+   if(i == 11) {
+     printf("Error in the header of %s.\n", name);
+     return 1;
+   }
+
+   tmp[i] = 0;
+   m->flags = atoi(tmp);
+
+   if(m->flags & ~OTP_FLAGS) {
+     printf("%s was written with flags (%d) that this decrypt.exe does not support.\n", name, m->flags);
+     return 1;
+   }
+ }
+
+ msg_buf += i + 1;
+
+ if(m->i_count < 0 || (size_t)(msg_buf - m->file_buf) + m->i_count > m->msg_len) {
+   printf("The header of %s claims %d bytes of encrypted message, but %s is too short.\n",
+          name, m->i_count, name);
+   return 1;
+ }
+
+ m->msg_buf = msg_buf;
+
+ return 0;
+}
+
+/* Start m->gen from z_seed, for the pad that will decrypt the parsed message. */
+static inline int otp_dec_begin(const otp_key *key, otp_msg *m, const mpz_t z_seed) {
+ size_t count;
+
+ if(m->flags & OTP_HYBRID) {
+   if(otp_gen_init(key, &m->gen, z_seed, 8 * OTP_HYBRID_BYTES)) return 1;
+   m->have_gen = 1;
+   return 0;
+ }
+
+ m->chk_buf = (char*)malloc(1 + m->i_count);
+ if(m->chk_buf == NULL) {
+   printf("Failed to allocate memory to chk_buf.\n");
+   return 1;
+ }
+
+ mpz_init(m->z_msg);
+ m->have_z = 1;
+
+ m->msg_buf[m->i_count] = 0;
+
+ mpz_import(m->z_msg, m->i_count, 1, 1, 0, 0, m->msg_buf);
+
+ if(m->debug) {
+   printf("ENCRYPTED MESSAGE:\n");
+   mpz_out_str(stdout, 16, m->z_msg);
+   printf("\n\n");
+ }
+
+ mpz_export(m->chk_buf, &count, 1, 1, 0, 0, m->z_msg);
+ m->chk_buf[count] = 0;
+
+ if(strcmp(m->msg_buf, m->chk_buf)) {
+   printf("<%s>\nIS NOT:\n<%s>\n", m->msg_buf, m->chk_buf);
+   return 1;
+ }
+
+ if(otp_gen_init(key, &m->gen, z_seed, m->i_bitsize)) return 1;
+ m->have_gen = 1;
+
+ return 0;
+}
+
+/* With m->gen run to completion, decrypt (and decompress) the message into *
+ * m->out_buf and m->out_len.                                                 */
+static inline int otp_dec_end(const otp_key *key, otp_msg *m) {
+ unsigned char hkey[OTP_HYBRID_BYTES];
+ mpz_t z_dec;
+ size_t bitsize, count, raw_len;
+
+ otp_gen_finish(key, &m->gen, NULL);
+
+ if(m->flags & OTP_HYBRID) {
+   otp_export(hkey, OTP_HYBRID_BYTES, m->gen.z_pad);
+
+   chacha20_xor(hkey, hkey + 32, 0, (unsigned char*)m->msg_buf, m->i_count);
+   memset(hkey, 0, sizeof(hkey));
+
+   if(m->debug) printf("ChaCha20 kernel: %s\n", chacha20_kernel_name);
+
+   m->out_buf = m->msg_buf;
+   m->out_len = m->i_count;
+ }
+ else {
+   if(m->debug) {
+     printf("PAD:\n");
+     mpz_out_str(stdout, 16, m->gen.z_pad);
+     printf("\n\n");
+   }
+
+   mpz_init(z_dec);
+   mpz_xor(z_dec, m->z_msg, m->gen.z_pad);
+
+   if(m->debug) {
+     printf("bitsize of encrypted message: %d\n", (int)mpz_sizeinbase(m->z_msg, 2));
+     printf("bitsize of pad: %d\n", (int)mpz_sizeinbase(m->gen.z_pad, 2));
+     printf("bitsize of decrypted message: %d\n", (int)mpz_sizeinbase(z_dec, 2));
+   }
+
+   if(m->debug) {
+     printf("DECRYPTED MESSAGE:\n");
+     mpz_out_str(stdout, 16, z_dec);
+     printf("\n\n");
+   }
+
+   bitsize = mpz_sizeinbase(z_dec, 2);
+
+   m->out_len = bitsize / 8;
+   if(bitsize % 8) m->out_len++;
+
+   m->dec_buf = (char*)malloc(1 + m->out_len);
+   if(m->dec_buf == NULL) {
+     printf("Failed to allocate memory to dec_buf.\n");
+     mpz_clear(z_dec);
+     return 1;
+   }
+
+   mpz_export(m->dec_buf, &count, 1, 1, 0, 0, z_dec);
+   m->dec_buf[count] = 0;
+   m->out_buf = m->dec_buf;
+
+   mpz_clear(z_dec);
+ }
+
+ mpz_set_ui(m->gen.z_pad, 0);
+
+ if(m->flags & OTP_COMPRESSED) {
+   if(otpz_raw_size((unsigned char*)m->out_buf, m->out_len, &raw_len)) {
+     printf("The decrypted message is not a valid compressed stream.\n");
+     return 1;
+   }
+
+   m->z_buf = (char*)malloc(1 + raw_len);
+   if(m->z_buf == NULL) {
+     printf("Failed to allocate memory to decompression buffer.\n");
+     return 1;
+   }
+
+   if(otpz_decompress((unsigned char*)m->out_buf, m->out_len, (unsigned char*)m->z_buf, raw_len)) {
+     printf("Decompression of the decrypted message failed.\n");
+     return 1;
+   }
+
+   m->out_buf = m->z_buf;
+   m->out_len = raw_len;
+ }
+
+ return 0;
+}
+
+#endif
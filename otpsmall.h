@@ -0,0 +1,154 @@
+/*******************************************************************************************
+ * Copyright 2020 sisyphus                                                                 *
+ *                                                                                         *
+ * otpsmall.h - encryption of short messages (up to OTP_SMALL_BLOCKS k bit blocks of pad,  *
+ * and no more than OTP_SMALL_BYTES bytes) without going through otpmsg.h. For a message   *
+ * that short, the mallocs of otp_enc_begin() and otp_enc_end(), the mpz_t they initialise *
+ * and their export/import round trips cost more than the MicaliSchnorr steps themselves.  *
+ *                                                                                         *
+ * Everything here works in an otp_small, set up once with otp_small_init(): its two mpz_t *
+ * are given room enough for any step of the generator before the first message, the pad  *
+ * is OR'd together in a fixed array of limbs, and the message is XOR'd with it (or, in    *
+ * HYBRID mode, with the ChaCha20 keystream that it keys) a byte at a time and framed      *
+ * behind the header in a fixed output buffer. Nothing is allocated per message.           *
+ *                                                                                         *
+ * The output is byte for byte what encrypt.exe writes by the usual route - a message that *
+ * the usual route would reject (a plain message with leading NULL bytes) is left to it,   *
+ * so that it's rejected in the usual way.                                                 *
+ *******************************************************************************************/
+
+#ifndef OTPSMALL_H
+#define OTPSMALL_H
+
+#include <stdio.h>
+#include <string.h>
+#include <gmp.h>
+#include "otp.h"
+#include "chacha20.h"
+#include "otpmsg.h"
+
+#define OTP_SMALL_BLOCKS 4
+#define OTP_SMALL_BYTES  512
+#define OTP_SMALL_LIMBS  128  /* room for the pad - OTP_SMALL_BLOCKS blocks of a key up to 8192 bits */
+
+typedef struct {
+ mpz_t z_seed, z_x;
+ mp_limb_t pad[OTP_SMALL_LIMBS + 2];
+ unsigned char in[OTP_SMALL_BYTES + 1];
+ unsigned char out[48 + OTP_SMALL_BYTES];
+ size_t out_len;
+ int i_bitsize;       /* as in the header */
+} otp_small;
+
+static inline void otp_small_init(otp_small *s, const otp_key *key) {
+ mpz_init2(s->z_seed, key->N + GMP_NUMB_BITS);
+ mpz_init2(s->z_x, 2 * (key->N + GMP_NUMB_BITS));
+}
+
+static inline void otp_small_clear(otp_small *s) {
+ mpz_clear(s->z_seed);
+ mpz_clear(s->z_x);
+ memset(s->pad, 0, sizeof(s->pad));
+}
+
+/* The bits of pad that the len bytes at in (flags as in the header) need. With in NULL *
+ * all 8 * len bits of a plain message are taken to be used, as many as they can be.    */
+static inline size_t otp_small_bits(const unsigned char *in, size_t len, int flags) {
+ size_t bits;
+ unsigned int top;
+
+ if(flags & OTP_HYBRID) return 8 * OTP_HYBRID_BYTES;
+ if(in == NULL) return 8 * len;
+
+ for(top = in[0], bits = 8 * (len - 1); top; top >>= 1) bits++;
+ return bits;
+}
+
+/* The iterations that the message needs - or 0 if it isn't one for the fast path. Call *
+ * it with in NULL to rule out a message before it's read, and again once it has been.  */
+static inline size_t otp_small_its(const otp_key *key, const unsigned char *in, size_t len, int flags) {
+ size_t its;
+
+ if(len == 0 || len > OTP_SMALL_BYTES || (flags & ~OTP_HYBRID)) return 0;
+ if(in != NULL && !(flags & OTP_HYBRID) && in[0] == 0) return 0;
+
+ its = (otp_small_bits(in, len, flags) + key->k - 1) / key->k;
+ if(its > OTP_SMALL_BLOCKS || its * key->k > OTP_SMALL_LIMBS * GMP_NUMB_BITS) return 0;
+
+ return its;
+}
+
+/* Byte j (counting from the least significant) of the pad, once it's been shifted down by sh. */
+static inline unsigned char otp_small_byte(const otp_small *s, size_t sh, size_t j) {
+ size_t bit = sh + 8 * j, w = bit / GMP_NUMB_BITS;
+ unsigned int b = bit % GMP_NUMB_BITS;
+ mp_limb_t v = s->pad[w] >> b;
+
+ if(b > GMP_NUMB_BITS - 8) v |= s->pad[w + 1] << (GMP_NUMB_BITS - b);
+
+ return (unsigned char)v;
+}
+
+/* Encrypt the len bytes at s->in with the seed i_seed into s->out (header included), *
+ * setting s->out_len. flags may be 0 or OTP_HYBRID, and otp_small_its() must have    *
+ * passed the message as read.                                                        */
+static inline int otp_small_enc(otp_small *s, const otp_key *key, int i_seed, int flags, size_t len) {
+ size_t bitsize = otp_small_bits(s->in, len, flags), its, nlimbs, sh, count, i;
+ unsigned char hkey[OTP_HYBRID_BYTES], *out;
+ otp_msg m;
+
+ its = (bitsize + key->k - 1) / key->k;
+ nlimbs = (its * key->k + GMP_NUMB_BITS - 1) / GMP_NUMB_BITS;
+ memset(s->pad, 0, (nlimbs + 2) * sizeof(mp_limb_t));
+
+ if(otp_seed(key, i_seed, s->z_seed)) return 1;
+
+ /* As otp_gen_step(), block i going in at the top of what's left. */
+ for(i = 0; i < its; i++) {
+   mpz_powm_ui(s->z_x, s->z_seed, key->e, key->z_phi);
+   otp_pad_put(key, s->pad, nlimbs, (size_t)key->k * (its - 1 - i), s->z_x);
+   mpz_fdiv_q_2exp(s->z_seed, s->z_x, key->k);
+ }
+
+ sh = its * key->k - bitsize; /* as otp_gen_finish() */
+
+ otp_msg_init(&m, NULL, len);
+ m.i_seed = i_seed;
+ m.flags = flags;
+
+ if(flags & OTP_HYBRID) {
+   for(i = 0; i < OTP_HYBRID_BYTES; i++)
+     hkey[OTP_HYBRID_BYTES - 1 - i] = otp_small_byte(s, sh, i);
+
+   m.i_count = (int)len;
+   m.i_bitsize = m.i_count * 8;
+   out = s->out + otp_msg_header((char*)s->out, &m, 0);
+
+   memcpy(out, s->in, len);
+   chacha20_xor(hkey, hkey + 32, 0, out, len);
+   memset(hkey, 0, sizeof(hkey));
+   count = len;
+ }
+ else {
+   /* The encrypted message loses its leading zero bytes, as it would to mpz_export(), *
+    * and the count in the header is of the bytes that are left.                      */
+   for(i = 0; i < len; i++)
+     s->in[i] ^= otp_small_byte(s, sh, len - 1 - i);
+   for(i = 0; i < len && s->in[i] == 0; i++);
+   count = len - i;
+
+   m.i_count = (int)count;
+   m.i_bitsize = (int)bitsize;
+   out = s->out + otp_msg_header((char*)s->out, &m, 0);
+   memcpy(out, s->in + i, count);
+ }
+
+ memset(s->pad, 0, (nlimbs + 2) * sizeof(mp_limb_t));
+
+ s->out_len = (out - s->out) + count;
+ s->i_bitsize = m.i_bitsize;
+
+ return 0;
+}
+
+#endif
@@ -0,0 +1,184 @@
+/*******************************************************************************************
+ * Copyright 2020 sisyphus                                                                 *
+ *                                                                                         *
+ * otpstate.h - the state that "encrypt.exe APPEND" keeps between runs, so that bytes added *
+ * to a growing "msg.in" can be encrypted onto the end of "msg.enc" without re-encrypting  *
+ * what's already there.                                                                   *
+ *                                                                                         *
+ * Appending n bytes must give exactly what encrypting the whole message in one go would   *
+ * have given, so the state records where the pad stream was left: the generator's next    *
+ * seed, plus the bits of its last k bit block that weren't needed (the "rest"). The next  *
+ * 8n pad bits are those rest bits followed by whatever more the generator has to produce. *
+ *                                                                                         *
+ * The seed is as secret as "primes.in", so the state file is created with mode 0600, and  *
+ * it's replaced atomically (written to a temporary file, then renamed over the old one).  *
+ * It's a short text file:                                                                 *
+ *                                                                                         *
+ *  otpstate 2                                                                             *
+ *  key N e fp     - checked against "primes.in": fp is the fingerprint of phi             *
+ *                   (otp_key_fingerprint()), as keys of one size share N and e            *
+ *  seed i_seed    - as in the header of msg.enc                                           *
+ *  flags f        - as in the header of msg.enc                                           *
+ *  count c        - bytes of encrypted message that follow the header of msg.enc          *
+ *  in n           - bytes of msg.in that have been encrypted                              *
+ *  rest bits hex  - the unused bits of the pad stream                                     *
+ *  state hex      - the seed that the generator continues from                            *
+ *                                                                                         *
+ * Each function prints a message describing any problem and returns non-zero.             *
+ *******************************************************************************************/
+
+#ifndef OTPSTATE_H
+#define OTPSTATE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <gmp.h>
+#include "otp.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#define OTPSTATE_POSIX 1
+#endif
+
+typedef struct {
+ unsigned int N, e;
+ unsigned long long fp;
+ int i_seed, flags;
+ size_t count, in_len, rest_bits;
+ mpz_t z_rest, z_seed;
+} otp_state;
+
+static inline void otp_state_init(otp_state *st) {
+ memset(st, 0, sizeof(*st));
+ mpz_init(st->z_rest);
+ mpz_init(st->z_seed);
+}
+
+static inline void otp_state_clear(otp_state *st) {
+ mpz_clear(st->z_rest);
+ mpz_clear(st->z_seed);
+}
+
+/* Read fname into st (already initialised). Returns -1, quietly, if there is no fname. */
+static inline int otp_state_load(const char *fname, otp_state *st) {
+ FILE *fp;
+ char tag[16];
+ unsigned long long count, in_len, rest_bits;
+ int version, ok;
+
+ fp = fopen(fname, "r");
+
+ if(fp == NULL) {
+   if(errno == ENOENT) return -1;
+   printf("Error while opening %s for reading.\n", fname);
+   return 1;
+ }
+
+ ok = fscanf(fp, "%15s %d", tag, &version) == 2 && !strcmp(tag, "otpstate") && version == 2
+   && fscanf(fp, " key %u %u %llx", &st->N, &st->e, &st->fp) == 3
+   && fscanf(fp, " seed %d", &st->i_seed) == 1
+   && fscanf(fp, " flags %d", &st->flags) == 1
+   && fscanf(fp, " count %llu", &count) == 1
+   && fscanf(fp, " in %llu", &in_len) == 1
+   && fscanf(fp, " rest %llu", &rest_bits) == 1
+   && gmp_fscanf(fp, " %Zx", st->z_rest) == 1
+   && gmp_fscanf(fp, " state %Zx", st->z_seed) == 1;
+
+ fclose(fp);
+
+ if(!ok) {
+   printf("%s is not a valid append state file.\n", fname);
+   return 1;
+ }
+
+ st->count = (size_t)count;
+ st->in_len = (size_t)in_len;
+ st->rest_bits = (size_t)rest_bits;
+
+ return 0;
+}
+
+/* Replace fname with the contents of st. */
+static inline int otp_state_save(const char *fname, const otp_state *st) {
+ FILE *fp;
+ char *tmp_name;
+ int ret;
+
+ tmp_name = (char*)malloc(strlen(fname) + 5);
+ if(tmp_name == NULL) {
+   printf("Failed to allocate memory to state file name.\n");
+   return 1;
+ }
+ sprintf(tmp_name, "%s.tmp", fname);
+
+#ifdef OTPSTATE_POSIX
+ {
+   int fd = open(tmp_name, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+   fp = fd < 0 ? NULL : fdopen(fd, "w");
+   if(fp == NULL && fd >= 0) close(fd);
+ }
+#else
+ fp = fopen(tmp_name, "w");
+#endif
+
+ if(fp == NULL) {
+   printf("Error while opening %s for writing.\n", tmp_name);
+   free(tmp_name);
+   return 1;
+ }
+
+ fprintf(fp, "otpstate 2\nkey %u %u %016llx\nseed %d\nflags %d\ncount %llu\nin %llu\n",
+         st->N, st->e, st->fp, st->i_seed, st->flags, (unsigned long long)st->count, (unsigned long long)st->in_len);
+ gmp_fprintf(fp, "rest %llu %Zx\nstate %Zx\n", (unsigned long long)st->rest_bits, st->z_rest, st->z_seed);
+
+ ret = fflush(fp) != 0;
+#ifdef OTPSTATE_POSIX
+ if(!ret) ret = fsync(fileno(fp)) != 0;
+#endif
+ if(fclose(fp)) ret = 1;
+
+ if(!ret && rename(tmp_name, fname)) ret = 1;
+
+ if(ret) {
+   printf("Failed to write %s.\n", fname);
+   remove(tmp_name);
+ }
+
+ free(tmp_name);
+ return ret;
+}
+
+/* Set z_pad (already initialised) to the next bits bits of the pad stream, and move st on. */
+static inline int otp_state_pad(const otp_key *key, otp_state *st, size_t bits, mpz_t z_pad) {
+ otp_gen g;
+ size_t more;
+
+ if(bits <= st->rest_bits) {
+   st->rest_bits -= bits;
+   mpz_fdiv_q_2exp(z_pad, st->z_rest, st->rest_bits);
+   mpz_fdiv_r_2exp(st->z_rest, st->z_rest, st->rest_bits);
+   return 0;
+ }
+
+ more = bits - st->rest_bits;
+
+ if(otp_gen_init(key, &g, st->z_seed, more)) return 1;
+
+ while(g.done < g.its)
+   otp_gen_step(key, &g);
+
+ mpz_mul_2exp(z_pad, st->z_rest, more);
+ otp_gen_finish(key, &g, st->z_rest);
+ mpz_ior(z_pad, z_pad, g.z_pad);
+
+ st->rest_bits = g.its * key->k - more;
+ mpz_swap(st->z_seed, g.z_seed);
+ otp_gen_clear(&g);
+
+ return 0;
+}
+
+#endif
@@ -0,0 +1,384 @@
+/*******************************************************************************************
+ * Copyright 2020 sisyphus                                                                 *
+ * The gmp library (https://gmplib.org) is required.                                       *
+ *                                                                                         *
+ * I build otptune.exe with: gcc -o otptune.exe otptune.c -lgmp -pthread                   *
+ * Usage: otptune.exe [QUICK] [DIRECT] [MB]                                                *
+ *                                                                                         *
+ * Times each stage of encryption on this machine with the key in "primes.in", and writes  *
+ * the fastest settings it finds to "otp.tune" (see otptune.h), where encrypt.exe,         *
+ * decrypt.exe and otpasync.hpp will find them. The trials are:                            *
+ *                                                                                         *
+ *  - one MicaliSchnorr step with GMP against one pass of the AVX512-IFMA kernel in msmb.h *
+ *    (which does 8 steps at once), to find how many generators that kernel is worth using *
+ *    for - or that it isn't worth using at all;                                           *
+ *  - each ChaCha20 kernel in chacha20.h that this CPU can run;                            *
+ *  - 1 up to the number of CPUs threads generating pad at once - the fewest that get      *
+ *    within 5% of the best rate is used by otpasync.hpp's compute pool;                   *
+ *  - writing and reading back an MB megabyte (64, or 8 if QUICK) file "otptune.tmp" with  *
+ *    io_uring at a range of request sizes and queue depths, and with stdio. Each write is *
+ *    fsync()'d and the file dropped from the page cache before it's read, so that it's    *
+ *    the storage that's timed. "DIRECT" uses O_DIRECT, as encrypt.exe DIRECT and          *
+ *    decrypt.exe DIRECT would.                                                            *
+ *                                                                                         *
+ * Each trial is repeated until it has taken long enough to time reliably (less long with  *
+ * QUICK). Run it again whenever "primes.in" is replaced or the program is moved to a      *
+ * different machine - a profile made for another key is ignored.                          *
+ *******************************************************************************************/
+
+#define _GNU_SOURCE /* for O_DIRECT in otpio.h */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <gmp.h>
+#include "otp.h"
+#include "chacha20.h"
+#include "otpio.h"
+#include "msmb.h"
+#include "otptune.h"
+
+#define TUNE_MAX_THREADS 64
+
+static double min_secs = 0.2; /* shortest time that a trial is trusted for */
+
+static double now(void) {
+ struct timespec ts;
+
+ clock_gettime(CLOCK_MONOTONIC, &ts);
+ return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* GMP steps of the generator, starting from (and updating) z. */
+static void gmp_steps(const otp_key *key, mpz_t z, long reps) {
+ long i;
+
+ for(i = 0; i < reps; i++) {
+   mpz_powm_ui(z, z, key->e, key->z_phi);
+   mpz_fdiv_q_2exp(z, z, key->k);
+ }
+}
+
+/* Seconds per GMP step. */
+static double time_gmp(const otp_key *key, mpz_t z) {
+ long reps = 16;
+ double t;
+
+ while(1) {
+   t = now();
+   gmp_steps(key, z, reps);
+   t = now() - t;
+   if(t >= min_secs) return t / reps;
+   reps *= 2;
+ }
+}
+
+/* Seconds per pass of the multi-buffer kernel (MSMB_LANES steps). Each lane starts from a *
+ * seed of its own, as the messages of a BATCH do - so every one is a proper r bit seed.  */
+static double time_msmb(const msmb_ctx *ctx, const otp_key *key) {
+ mpz_t y[MSMB_LANES], *zp[MSMB_LANES];
+ long reps = 16, i;
+ double t;
+
+ for(i = 0; i < MSMB_LANES; i++) {
+   mpz_init(y[i]);
+   if(otp_seed(key, 1 + (int)i, y[i])) exit(1);
+   zp[i] = &y[i];
+ }
+
+ while(1) {
+   t = now();
+   for(i = 0; i < reps * MSMB_LANES; i++) {
+     if(i % MSMB_LANES == 0) msmb_powm(ctx, zp, MSMB_LANES);
+     mpz_fdiv_q_2exp(y[i % MSMB_LANES], y[i % MSMB_LANES], key->k);
+   }
+   t = now() - t;
+   if(t >= min_secs) break;
+   reps *= 2;
+ }
+
+ for(i = 0; i < MSMB_LANES; i++)
+   mpz_clear(y[i]);
+
+ return t / reps;
+}
+
+/* Bytes per second for chacha20_xor() with the kernel that's in use. */
+static double time_chacha(unsigned char *buf, size_t len) {
+ static const unsigned char key[32] = {1}, nonce[12] = {2};
+ long reps = 1, i;
+ double t;
+
+ while(1) {
+   t = now();
+   for(i = 0; i < reps; i++)
+     chacha20_xor(key, nonce, 0, buf, len);
+   t = now() - t;
+   if(t >= min_secs) return (double)len * reps / t;
+   reps *= 2;
+ }
+}
+
+typedef struct {
+ const otp_key *key;
+ mpz_srcptr z;
+ long reps;
+} tune_worker;
+
+static void *worker(void *arg) {
+ tune_worker *w = (tune_worker *)arg;
+ mpz_t z;
+
+ mpz_init_set(z, w->z);
+ gmp_steps(w->key, z, w->reps);
+ mpz_clear(z);
+
+ return NULL;
+}
+
+/* GMP steps per second with n threads each doing reps of them. */
+static double time_threads(const otp_key *key, mpz_t z, int n, long reps) {
+ pthread_t th[TUNE_MAX_THREADS];
+ tune_worker w;
+ double t;
+ int i;
+
+ w.key = key;
+ w.z = z;
+ w.reps = reps;
+
+ t = now();
+ for(i = 0; i < n; i++) {
+   if(pthread_create(&th[i], NULL, worker, &w)) {
+     printf("Failed to start thread %d.\n", i + 1);
+     exit(1);
+   }
+ }
+ for(i = 0; i < n; i++)
+   pthread_join(th[i], NULL);
+
+ return (double)n * reps / (now() - t);
+}
+
+/* Push fname out to the storage and drop it from the page cache, so that reading it back *
+ * times the storage rather than a memcpy() from the cache.                               */
+static int flush_file(const char *fname) {
+ int fd = open(fname, O_RDONLY);
+
+ if(fd < 0) {
+   printf("Error while opening %s.\n", fname);
+   return 1;
+ }
+
+ if(fsync(fd)) {
+   printf("Error while syncing %s.\n", fname);
+   close(fd);
+   return 1;
+ }
+
+#ifdef POSIX_FADV_DONTNEED
+ posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+
+ close(fd);
+ return 0;
+}
+
+/* Seconds to write buf to fname, sync it, and read it back uncached with the current otpio *
+ * settings - repeated until that has taken min_secs - or -1 if it couldn't be done. *used   *
+ * is set to the backend that otpio.h chose.                                                 */
+static double time_io(const char *fname, char *buf, size_t len, const char **used) {
+ otpio_file f;
+ long reps = 0;
+ double t, el;
+
+ t = now();
+
+ do {
+   memset(&f, 0, sizeof(f));
+   f.fname = fname;
+   f.buf = buf;
+   f.len = len;
+   f.write = 1;
+   if(otpio_transfer(&f, 1) || flush_file(fname)) return -1;
+
+   memset(&f, 0, sizeof(f));
+   f.fname = fname;
+   f.buf = buf;
+   f.len = len;
+   if(otpio_transfer(&f, 1)) return -1;
+
+   reps++;
+   el = now() - t;
+ } while(el < min_secs);
+
+ *used = otpio_used;
+ return el / reps;
+}
+
+int main(int argc, char *argv[]) {
+ static const size_t chunks[] = {1 << 18, 1 << 20, 1 << 22};
+ static const unsigned depths[] = {4, 16, 64};
+ static const char *kernels[] = {"portable", "avx2", "avx512"};
+ int i, j, quick = 0, mb = 64, ncpu;
+ double t_gmp, t_mb, rate, best, rates[TUNE_MAX_THREADS + 1];
+ const char *used;
+ char *buf;
+ size_t len;
+ long reps;
+ mpz_t z;
+ otp_key key;
+ msmb_ctx *ctx;
+ otp_tune tune;
+
+ for(i = 1; i < argc; i++) {
+   if(!strcmp(argv[i], "QUICK")) quick = 1;
+   else if(!strcmp(argv[i], "DIRECT")) otpio_direct = 1;
+   else if(argv[i][0] >= '1' && argv[i][0] <= '9') mb = atoi(argv[i]);
+   else {
+     printf("Usage: otptune.exe [QUICK] [DIRECT] [MB]\n");
+     exit(1);
+   }
+ }
+
+ if(quick) {
+   min_secs = 0.02;
+   if(mb == 64) mb = 8;
+ }
+
+ if(otp_load_key("primes.in", &key)) exit(1);
+
+ memset(&tune, 0, sizeof(tune));
+ tune.N = key.N;
+ tune.e = key.e;
+ tune.fp = otp_key_fingerprint(&key);
+
+ mpz_init(z);
+ if(otp_seed(&key, 1, z)) exit(1);
+
+/**** MICALISCHNORR ****/
+
+ t_gmp = time_gmp(&key, z);
+ printf("gmp: %.1f us per step\n", t_gmp * 1e6);
+
+ strcpy(tune.msmb, "gmp");
+ tune.lanes = MSMB_MIN_LANES;
+
+ ctx = malloc(sizeof(msmb_ctx));
+ if(ctx == NULL) {
+   printf("Failed to allocate memory for the multi-buffer kernel.\n");
+   exit(1);
+ }
+
+ msmb_init(ctx, &key);
+
+ if(ctx->use) {
+   t_mb = time_msmb(ctx, &key);
+   printf("%s: %.1f us per %d steps\n", msmb_kernel_name, t_mb * 1e6, MSMB_LANES);
+
+   for(i = 1; i <= MSMB_LANES; i++) {
+     if(i * t_gmp >= t_mb) {
+       strcpy(tune.msmb, msmb_kernel_name);
+       tune.lanes = i;
+       break;
+     }
+   }
+ }
+ else printf("avx512ifma: not available\n");
+
+ free(ctx);
+
+/**** CHACHA20 ****/
+
+ if(chacha20_selftest()) exit(1);
+
+ len = quick ? 1 << 20 : 1 << 24;
+ buf = otpio_alloc((size_t)mb << 20 > len ? (size_t)mb << 20 : len);
+ if(buf == NULL) {
+   printf("Failed to allocate memory for the trials.\n");
+   exit(1);
+ }
+ memset(buf, 0x5a, len);
+
+ best = 0;
+ for(i = 0; i < 3; i++) {
+   if(chacha20_use(kernels[i])) {
+     printf("chacha20 %s: not available\n", kernels[i]);
+     continue;
+   }
+   rate = time_chacha((unsigned char *)buf, len);
+   printf("chacha20 %s: %.0f MB/s\n", kernels[i], rate / 1e6);
+   if(rate > best) {
+     best = rate;
+     strcpy(tune.chacha, kernels[i]);
+   }
+ }
+
+/**** THREADS ****/
+
+ ncpu = (int)sysconf(_SC_NPROCESSORS_ONLN);
+ if(ncpu < 1) ncpu = 1;
+ if(ncpu > TUNE_MAX_THREADS) ncpu = TUNE_MAX_THREADS;
+
+ reps = (long)(min_secs / t_gmp) + 1;
+ best = 0;
+ for(i = 1; i <= ncpu; i++) {
+   rates[i] = time_threads(&key, z, i, reps);
+   printf("%d thread%s: %.0f steps/s\n", i, i > 1 ? "s" : "", rates[i]);
+   if(rates[i] > best) best = rates[i];
+ }
+
+ for(i = 1; rates[i] < 0.95 * best; i++);
+ tune.threads = i;
+
+ mpz_clear(z);
+
+/**** I/O ****/
+
+ len = (size_t)mb << 20;
+ memset(buf, 0xa5, len);
+
+ otpio_mode = OTPIO_STDIO;
+ best = time_io("otptune.tmp", buf, len, &used);
+ if(best < 0) exit(1);
+ printf("stdio: %.0f MB/s\n", 2.0 * len / best / 1e6);
+ strcpy(tune.io, "stdio");
+ tune.chunk = OTPIO_CHUNK;
+ tune.depth = OTPIO_DEPTH;
+
+ otpio_mode = OTPIO_AUTO;
+ for(i = 0; i < 3; i++) {
+   for(j = 0; j < 3; j++) {
+     otpio_chunk = chunks[i];
+     otpio_depth = depths[j];
+     rate = time_io("otptune.tmp", buf, len, &used);
+     if(rate < 0) exit(1);
+     if(strcmp(used, "io_uring")) {
+       printf("io_uring: not available\n");
+       i = j = 3;
+       break;
+     }
+     printf("io_uring %luK x %u: %.0f MB/s\n", (unsigned long)chunks[i] >> 10, depths[j], 2.0 * len / rate / 1e6);
+     if(rate < best) {
+       best = rate;
+       strcpy(tune.io, "io_uring");
+       tune.chunk = chunks[i];
+       tune.depth = depths[j];
+     }
+   }
+ }
+
+ remove("otptune.tmp");
+ free(buf);
+ mpz_clear(key.z_phi);
+
+ if(otp_tune_save(OTP_TUNE_FILE, &tune)) exit(1);
+
+ printf("%s: msmb %s %d, chacha %s, io %s %lu %u, threads %d\n", OTP_TUNE_FILE, tune.msmb, tune.lanes,
+        tune.chacha, tune.io, tune.chunk, tune.depth, tune.threads);
+
+ return 0;
+}
@@ -0,0 +1,160 @@
+/*******************************************************************************************
+ * Copyright 2020 sisyphus                                                                 *
+ *                                                                                         *
+ * otptune.h - the profile that otptune.exe writes to "otp.tune" after timing the stages of *
+ * encryption on this machine with this "primes.in", and that encrypt.exe and decrypt.exe  *
+ * (and otpasync.hpp) then apply by themselves:                                            *
+ *                                                                                         *
+ *  otptune 2                                                                              *
+ *  key N e fp           - the profile only applies to this key: fp is the fingerprint of  *
+ *                         phi (otp_key_fingerprint()), as keys of one size share N and e  *
+ *  msmb kernel lanes    - "avx512ifma" or "gmp", and the fewest generators that the       *
+ *                         multi-buffer kernel is worth running for (msmb.h)               *
+ *  chacha kernel        - "avx512", "avx2" or "portable" (chacha20.h)                     *
+ *  io backend chunk depth - "io_uring" or "stdio", with the request size and the number   *
+ *                         kept in flight (otpio.h)                                        *
+ *  threads n            - compute threads for otpasync.hpp                                *
+ *                                                                                         *
+ * A profile from another machine can name kernels that this one lacks - those settings    *
+ * are left at their defaults. STDIO on the command line still wins over the profile. The  *
+ * profile is replaced atomically (written to a temporary file, then renamed over the old  *
+ * one).                                                                                   *
+ *                                                                                         *
+ * Each function prints a message describing any problem and returns non-zero.             *
+ *******************************************************************************************/
+
+#ifndef OTPTUNE_H
+#define OTPTUNE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "otp.h"
+#include "chacha20.h"
+#include "otpio.h"
+#include "msmb.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#define OTPTUNE_POSIX 1
+#endif
+
+#define OTP_TUNE_FILE "otp.tune"
+
+typedef struct {
+ unsigned int N, e;
+ unsigned long long fp;
+ char msmb[16], chacha[16], io[16];
+ int lanes, threads;
+ unsigned long chunk;
+ unsigned int depth;
+} otp_tune;
+
+/* Read fname into t. Returns -1, quietly, if there is no fname. */
+static inline int otp_tune_load(const char *fname, otp_tune *t) {
+ FILE *fp;
+ char tag[16];
+ int version, ok;
+
+ memset(t, 0, sizeof(*t));
+ fp = fopen(fname, "r");
+
+ if(fp == NULL) {
+   if(errno == ENOENT) return -1;
+   printf("Error while opening %s for reading.\n", fname);
+   return 1;
+ }
+
+ ok = fscanf(fp, "%15s %d", tag, &version) == 2 && !strcmp(tag, "otptune") && version == 2
+   && fscanf(fp, " key %u %u %llx", &t->N, &t->e, &t->fp) == 3
+   && fscanf(fp, " msmb %15s %d", t->msmb, &t->lanes) == 2
+   && fscanf(fp, " chacha %15s", t->chacha) == 1
+   && fscanf(fp, " io %15s %lu %u", t->io, &t->chunk, &t->depth) == 3
+   && fscanf(fp, " threads %d", &t->threads) == 1;
+
+ fclose(fp);
+
+ if(!ok || t->lanes < 1 || t->threads < 1 || t->chunk < OTPIO_ALIGN || t->chunk % OTPIO_ALIGN ||
+    t->depth < 1 || t->depth > OTPIO_MAX_DEPTH) {
+   printf("%s is not a valid tuning profile - run otptune.exe again.\n", fname);
+   return 1;
+ }
+
+ return 0;
+}
+
+/* Replace fname with t - atomically, as in otpstate.h, so that an interrupted otptune.exe *
+ * leaves the old profile (or none), never a truncated one.                               */
+static inline int otp_tune_save(const char *fname, const otp_tune *t) {
+ FILE *fp;
+ char *tmp_name;
+ int ret;
+
+ tmp_name = (char*)malloc(strlen(fname) + 5);
+ if(tmp_name == NULL) {
+   printf("Failed to allocate memory to profile file name.\n");
+   return 1;
+ }
+ sprintf(tmp_name, "%s.tmp", fname);
+
+ fp = fopen(tmp_name, "w");
+
+ if(fp == NULL) {
+   printf("Error while opening %s for writing.\n", tmp_name);
+   free(tmp_name);
+   return 1;
+ }
+
+ fprintf(fp, "otptune 2\nkey %u %u %016llx\nmsmb %s %d\nchacha %s\nio %s %lu %u\nthreads %d\n",
+         t->N, t->e, t->fp, t->msmb, t->lanes, t->chacha, t->io, t->chunk, t->depth, t->threads);
+
+ ret = fflush(fp) != 0;
+#ifdef OTPTUNE_POSIX
+ if(!ret) ret = fsync(fileno(fp)) != 0;
+#endif
+ if(fclose(fp)) ret = 1;
+
+ if(!ret && rename(tmp_name, fname)) ret = 1;
+
+ if(ret) {
+   printf("Error while writing %s.\n", fname);
+   remove(tmp_name);
+ }
+
+ free(tmp_name);
+ return ret;
+}
+
+/* Apply t, which was loaded for key. */
+static inline int otp_tune_apply(const otp_tune *t, const otp_key *key) {
+ if(t->N != key->N || t->e != key->e || t->fp != otp_key_fingerprint(key)) {
+   printf("%s was made for a different primes.in - run otptune.exe again.\n", OTP_TUNE_FILE);
+   return 1;
+ }
+
+ msmb_disable = !strcmp(t->msmb, "gmp");
+ msmb_min_lanes = t->lanes > MSMB_LANES ? MSMB_LANES : t->lanes;
+
+ if(chacha20_use(t->chacha))
+   printf("The %s ChaCha20 kernel in %s isn't available here - using the default.\n", t->chacha, OTP_TUNE_FILE);
+
+ if(otpio_mode == OTPIO_AUTO && !strcmp(t->io, "stdio")) otpio_mode = OTPIO_STDIO;
+ otpio_chunk = t->chunk;
+ otpio_depth = t->depth;
+
+ return 0;
+}
+
+/* Apply "otp.tune" if there is one. A missing or unusable profile just leaves the defaults. */
+static inline void otp_tune_use(const otp_key *key, int debug) {
+ otp_tune t;
+
+ if(otp_tune_load(OTP_TUNE_FILE, &t) || otp_tune_apply(&t, key)) return;
+
+ if(debug)
+   printf("%s: msmb %s %d, chacha %s, io %s %lu %u\n", OTP_TUNE_FILE, t.msmb, t.lanes, t.chacha, t.io,
+          t.chunk, t.depth);
+}
+
+#endif
@@ -0,0 +1,273 @@
+/*******************************************************************************************
+ * Copyright 2020 sisyphus                                                                 *
+ *                                                                                         *
+ * otpz.h - a small, fast LZ77 codec (in the manner of LZ4) that encrypt.exe can apply to  *
+ * "msg.in" before it is encrypted, and that decrypt.exe reverses after the pad has been   *
+ * XOR'd away. Every byte that is compressed away is a byte for which no keystream needs   *
+ * to be generated.                                                                        *
+ *                                                                                         *
+ * The compressed stream is a single OTPZ_MAGIC byte followed by a run of blocks, each of  *
+ * which covers at most OTPZ_BLOCK bytes of the original message:                          *
+ *                                                                                         *
+ *  'S' raw_len(3)              raw_len bytes, stored as is.                               *
+ *  'C' raw_len(3) comp_len(3)  comp_len bytes of LZ sequences that expand to raw_len.     *
+ *                                                                                         *
+ * (Lengths are 3 byte big-endian values.) Blocks are independent of each other, and a     *
+ * block that doesn't shrink is automatically written in stored ('S') form.                *
+ * The leading OTPZ_MAGIC byte is non-zero, so the stream survives the mpz_import() and    *
+ * mpz_export() round trip that encrypt.exe and decrypt.exe put it through, even when the  *
+ * original message began with NULL bytes.                                                *
+ *                                                                                         *
+ * An LZ sequence is a token byte (literal count in the high nibble, match length - 4 in   *
+ * the low nibble, with 15 meaning "more length bytes follow"), the literals, then a 2     *
+ * byte little-endian match offset. The final sequence of a block carries literals only.   *
+ *******************************************************************************************/
+
+#ifndef OTPZ_H
+#define OTPZ_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define OTPZ_MAGIC     0x5a      /* 'Z' */
+#define OTPZ_BLOCK     65536
+#define OTPZ_HASH_LOG  14
+#define OTPZ_MIN_MATCH 4
+#define OTPZ_MAX_DIST  65535
+
+/* Largest number of bytes that otpz_compress() can write for an input of len bytes. */
+static inline size_t otpz_bound(size_t len) {
+ return 1 + len + 4 * (len / OTPZ_BLOCK + 1);
+}
+
+static inline uint32_t otpz_read32(const unsigned char *p) {
+ uint32_t v;
+ memcpy(&v, p, 4);
+ return v;
+}
+
+static inline unsigned int otpz_hash(uint32_t v) {
+ return (v * 2654435761u) >> (32 - OTPZ_HASH_LOG);
+}
+
+static inline void otpz_put24(unsigned char *p, size_t v) {
+ p[0] = (unsigned char)(v >> 16);
+ p[1] = (unsigned char)(v >> 8);
+ p[2] = (unsigned char)v;
+}
+
+static inline size_t otpz_get24(const unsigned char *p) {
+ return ((size_t)p[0] << 16) | ((size_t)p[1] << 8) | p[2];
+}
+
+static inline unsigned char *otpz_putlen(unsigned char *op, size_t len) {
+ for(len -= 15; len >= 255; len -= 255)
+   *op++ = 255;
+ *op++ = (unsigned char)len;
+ return op;
+}
+
+/* Compress the n (<= OTPZ_BLOCK) bytes at src into at most cap bytes at dst.  *
+ * Returns the compressed size, or 0 if the result would not fit within cap.   */
+static inline size_t otpz_block(const unsigned char *src, size_t n, unsigned char *dst, size_t cap) {
+ uint32_t table[1 << OTPZ_HASH_LOG];
+ const unsigned char *ip = src, *anchor = src, *match;
+ const unsigned char *end = src + n;
+ const unsigned char *mflimit = n > 12 ? end - 12 : src; /* no match starts after here */
+ const unsigned char *mlimit = n > 5 ? end - 5 : src;    /* and none extends past here */
+ unsigned char *op = dst, *oend = dst + cap, *token;
+ size_t lit, ml, off;
+ unsigned int h;
+
+ memset(table, 0, sizeof(table));
+
+ while(ip < mflimit) {
+   h = otpz_hash(otpz_read32(ip));
+   match = table[h] ? src + table[h] - 1 : NULL;
+   table[h] = (uint32_t)(ip - src) + 1;
+
+   if(match == NULL || ip - match > OTPZ_MAX_DIST || otpz_read32(match) != otpz_read32(ip)) {
+     ip += 1 + ((ip - anchor) >> 6); /* skip faster through data that isn't matching */
+     continue;
+   }
+
+   for(ml = OTPZ_MIN_MATCH; ip + ml < mlimit && match[ml] == ip[ml]; ml++);
+
+   lit = ip - anchor;
+   if((size_t)(oend - op) < 1 + lit + lit / 255 + 1 + 2 + ml / 255 + 1) return 0;
+
+   token = op++;
+   *token = (unsigned char)((lit >= 15 ? 15 : lit) << 4);
+   if(lit >= 15) op = otpz_putlen(op, lit);
+   memcpy(op, anchor, lit);
+   op += lit;
+
+   off = ip - match;
+   *op++ = (unsigned char)off;
+   *op++ = (unsigned char)(off >> 8);
+
+   ml -= OTPZ_MIN_MATCH;
+   *token |= (unsigned char)(ml >= 15 ? 15 : ml);
+   if(ml >= 15) op = otpz_putlen(op, ml);
+
+   ip += ml + OTPZ_MIN_MATCH;
+   anchor = ip;
+ }
+
+ lit = end - anchor;
+ if((size_t)(oend - op) < 1 + lit + lit / 255 + 1) return 0;
+
+ token = op++;
+ *token = (unsigned char)((lit >= 15 ? 15 : lit) << 4);
+ if(lit >= 15) op = otpz_putlen(op, lit);
+ memcpy(op, anchor, lit);
+ op += lit;
+
+ return op - dst;
+}
+
+/* Expand the n bytes at src into exactly raw bytes at dst. Returns 0 on success. */
+static inline int otpz_unblock(const unsigned char *src, size_t n, unsigned char *dst, size_t raw) {
+ const unsigned char *ip = src, *iend = src + n, *match;
+ unsigned char *op = dst, *oend = dst + raw;
+ size_t lit, ml, off;
+ unsigned char token, b;
+
+ while(ip < iend) {
+   token = *ip++;
+
+   lit = token >> 4;
+   if(lit == 15) {
+     do {
+       if(ip >= iend) return 1;
+       b = *ip++;
+       lit += b;
+     } while(b == 255);
+   }
+
+   if(lit > (size_t)(iend - ip) || lit > (size_t)(oend - op)) return 1;
+   memcpy(op, ip, lit);
+   ip += lit;
+   op += lit;
+
+   if(ip == iend) break; /* final sequence: literals only */
+
+   if(iend - ip < 2) return 1;
+   off = ip[0] | ((size_t)ip[1] << 8);
+   ip += 2;
+   if(off == 0 || off > (size_t)(op - dst)) return 1;
+
+   ml = token & 15;
+   if(ml == 15) {
+     do {
+       if(ip >= iend) return 1;
+       b = *ip++;
+       ml += b;
+     } while(b == 255);
+   }
+   ml += OTPZ_MIN_MATCH;
+
+   if(ml > (size_t)(oend - op)) return 1;
+   for(match = op - off; ml; ml--)   /* byte by byte - source and destination may overlap */
+     *op++ = *match++;
+ }
+
+ return op != oend;
+}
+
+/* Compress the n (at most OTPZ_BLOCK) bytes at in as the next block of a stream, writing *
+ * at most 4 + n bytes to out. Returns the number of bytes written.                      */
+static inline size_t otpz_compress_block(const unsigned char *in, size_t n, unsigned char *out) {
+ size_t c;
+
+ /* Only keep the compressed form if it beats the 4 byte 'S' header + n. */
+ c = n > 16 ? otpz_block(in, n, out + 7, n - 4) : 0;
+
+ if(c) {
+   out[0] = 'C';
+   otpz_put24(out + 1, n);
+   otpz_put24(out + 4, c);
+   return 7 + c;
+ }
+
+ out[0] = 'S';
+ otpz_put24(out + 1, n);
+ memcpy(out + 4, in, n);
+ return 4 + n;
+}
+
+/* Compress len bytes at in, writing at most otpz_bound(len) bytes to out. *
+ * Returns the number of bytes written. A stream can also be put together  *
+ * a block at a time: OTPZ_MAGIC, then otpz_compress_block() for each.     */
+static inline size_t otpz_compress(const unsigned char *in, size_t len, unsigned char *out) {
+ unsigned char *op = out;
+ size_t pos, n;
+
+ *op++ = OTPZ_MAGIC;
+
+ for(pos = 0; pos < len; pos += n) {
+   n = len - pos < OTPZ_BLOCK ? len - pos : OTPZ_BLOCK;
+   op += otpz_compress_block(in + pos, n, op);
+ }
+
+ return op - out;
+}
+
+/* Walk the block headers of a compressed stream, setting *raw to the size that  *
+ * it will decompress to. Returns 0 on success, non-zero if the stream is broken. */
+static inline int otpz_raw_size(const unsigned char *in, size_t len, size_t *raw) {
+ size_t pos = 1, n, c;
+
+ *raw = 0;
+ if(len < 1 || in[0] != OTPZ_MAGIC) return 1;
+
+ while(pos < len) {
+   if(len - pos < 4) return 1;
+   n = otpz_get24(in + pos + 1);
+   if(n == 0 || n > OTPZ_BLOCK) return 1;
+
+   if(in[pos] == 'S') c = n, pos += 4;
+   else if(in[pos] == 'C' && len - pos >= 7) c = otpz_get24(in + pos + 4), pos += 7;
+   else return 1;
+
+   if(c > len - pos) return 1;
+   pos += c;
+   *raw += n;
+ }
+
+ return 0;
+}
+
+/* Decompress the len bytes at in into the raw bytes (as reported by otpz_raw_size()) *
+ * at out. Returns 0 on success, non-zero if the stream is broken.                    */
+static inline int otpz_decompress(const unsigned char *in, size_t len, unsigned char *out, size_t raw) {
+ size_t pos = 1, done = 0, n, c;
+
+ if(len < 1 || in[0] != OTPZ_MAGIC) return 1;
+
+ while(pos < len) {
+   if(len - pos < 4) return 1;
+   n = otpz_get24(in + pos + 1);
+   if(n == 0 || n > OTPZ_BLOCK || n > raw - done) return 1;
+
+   if(in[pos] == 'S') {
+     pos += 4;
+     if(n > len - pos) return 1;
+     memcpy(out + done, in + pos, n);
+     pos += n;
+   }
+   else if(in[pos] == 'C' && len - pos >= 7) {
+     c = otpz_get24(in + pos + 4);
+     pos += 7;
+     if(c > len - pos || otpz_unblock(in + pos, c, out + done, n)) return 1;
+     pos += c;
+   }
+   else return 1;
+
+   done += n;
+ }
+
+ return done != raw;
+}
+
+#endif
@@ -1,6 +1,8 @@
 use strict;
 use warnings;
 use Digest::SHA qw(sha256_hex);
+use File::Spec;
+use File::Path;
 
 my $file1 = "msg.in";
 my $file2 = "msg.dec";
@@ -72,6 +74,306 @@ for(1..100) {
   $digest4 = $digest3;
 }
 
+# Then the same for the HYBRID option, which must also cope with a "msg.in" that starts with NULL bytes.
+# This also cycles through the DIRECT and STDIO I/O options.
+
+$digest4 = '';
+
+for(1..20) {
+  open $wr, '>', "msg.in" or die "Cannot open 'msg.in' for writing";
+  binmode($wr);
+  print $wr chr(0) x ($_ % 3);
+  print $wr chr(int(rand(256))) for 1..$filesize * $_;
+  close $wr or die "Cannot close 'msg.in' after writing";
+
+  my $io = ('', 'DIRECT', 'STDIO')[$_ % 3];
+  system "$enc HYBRID $io";
+  system "$dec $io";
+  my $digest1 = dig($file1);
+  my $digest2 = dig($file2);
+  my $digest3 = dig($file3);
+
+  if($digest1 eq $digest2 && $digest3 ne $digest2 && $digest3 ne $digest4) {
+    print "ok hybrid $_\n";
+  }
+  else {
+    die "Failed for hybrid $_:\n$digest1\n$digest2\n$digest3\n $digest4\n";
+  }
+
+  $digest4 = $digest3;
+}
+
+# Messages of a few hundred bytes or less take the fast path in otpsmall.h - plain ones
+# (which mustn't start with a NULL byte) and HYBRID ones alike.
+
+$digest4 = '';
+
+for(1..20) {
+  open $wr, '>', "msg.in" or die "Cannot open 'msg.in' for writing";
+  binmode($wr);
+  print $wr chr(1 + int(rand(255)));
+  print $wr chr(int(rand(256))) for 2..int(rand(20 * $_));
+  close $wr or die "Cannot close 'msg.in' after writing";
+
+  system $_ & 1 ? $enc : "$enc HYBRID";
+  system $dec;
+  my $digest1 = dig($file1);
+  my $digest2 = dig($file2);
+  my $digest3 = dig($file3);
+
+  if($digest1 eq $digest2 && $digest3 ne $digest2 && $digest3 ne $digest4) {
+    print "ok short $_\n";
+  }
+  else {
+    die "Failed for short $_:\n$digest1\n$digest2\n$digest3\n $digest4\n";
+  }
+
+  $digest4 = $digest3;
+}
+
+# Now check the COMPRESS option against a "msg.in" that consists of repetitive, log-like text.
+# It must still decrypt to the original, and "msg.enc" must be smaller than "msg.in".
+
+open $wr, '>', "msg.in" or die "Cannot open 'msg.in' for writing";
+binmode($wr);
+
+for(1..200 + int(rand(200))) {
+  print $wr "line $_: status=ok latency=", int(rand(1000)), "ms user=", int(rand(50)), "\n";
+}
+
+close $wr or die "Cannot close 'msg.in' after writing";
+
+for(1..10) {
+  system $_ & 1 ? "$enc COMPRESS" : "$enc COMPRESS HYBRID";
+  system $dec;
+
+  if(dig($file1) eq dig($file2) && -s $file3 < -s $file1) {
+    print "ok compress $_\n";
+  }
+  else {
+    die "Failed for compress $_: ", -s $file1, " ", -s $file2, " ", -s $file3, "\n";
+  }
+}
+
+# Finally the BATCH option - 12 files of differing sizes, enough that the pad generators
+# outnumber the lanes of the multi-buffer kernel. Each file must decrypt to the original,
+# and no two of the encrypted files may be the same.
+
+my @batch = map { "batch$_.in" } 1..12;
+
+for(1..4) {
+  my $opt = ('', 'HYBRID', 'COMPRESS', 'HYBRID STDIO')[$_ - 1];
+
+  for my $i (0..$#batch) {
+    open $wr, '>', $batch[$i] or die "Cannot open '$batch[$i]' for writing";
+    binmode($wr);
+    print $wr chr(1 + int(rand(255)));
+    print $wr chr(int(rand(256))) for 1..$filesize * ($i + 1);
+    close $wr or die "Cannot close '$batch[$i]' after writing";
+  }
+
+  system "$enc $opt BATCH @batch";
+  system "$dec BATCH " . join ' ', map { "$_.enc" } @batch;
+
+  my %seen;
+  for my $f (@batch) {
+    (my $d = $f) =~ s/\.in$/.in.dec/;
+    die "Failed for batch $_: $f\n" unless dig($f) eq dig($d);
+    die "Failed for batch $_: $f.enc repeats\n" if $seen{dig("$f.enc")}++;
+  }
+
+  print "ok batch $_\n";
+}
+
+unlink map { ($_, "$_.enc", "$_.dec") } @batch;
+
+# And the APPEND option - "msg.in" grows between runs, as a log would, and after each run
+# "msg.enc" must decrypt to the whole of the current "msg.in".
+
+for(1..4) {
+  my $opt = ('', 'HYBRID', 'COMPRESS', 'COMPRESS HYBRID')[$_ - 1];
+  unlink "msg.enc.state";
+
+  open $wr, '>', "msg.in" or die "Cannot open 'msg.in' for writing";
+  binmode($wr);
+  print $wr "start\n";
+  close $wr or die "Cannot close 'msg.in' after writing";
+
+  for my $run (1..5) {
+    open $wr, '>>', "msg.in" or die "Cannot open 'msg.in' for appending";
+    binmode($wr);
+    print $wr "run $run: event=", int(rand(1000)), "\n" for 1..int(rand(50));
+    print $wr chr(int(rand(256))) for 1..int(rand($filesize));
+    close $wr or die "Cannot close 'msg.in' after appending";
+
+    system "$enc APPEND $opt";
+    system $dec;
+    die "Failed for append $_ (run $run)\n" unless dig($file1) eq dig($file2);
+  }
+
+  print "ok append $_\n";
+}
+
+unlink "msg.enc.state";
+
+# The JOURNAL option - an encryption or decryption that's killed part way through must carry on
+# from its last checkpoint when it's run again. (Where it can't be killed, it just runs twice.)
+
+open $wr, '>', "msg.in" or die "Cannot open 'msg.in' for writing";
+binmode($wr);
+print $wr chr(1 + int(rand(255)));
+print $wr chr(int(rand(256))) for 1..$filesize * 400;
+close $wr or die "Cannot close 'msg.in' after writing";
+
+for(1..3) {
+  for my $cmd ("$enc JOURNAL 0", "$dec JOURNAL 0") {
+    unless($^O =~ /MSWin32/i) {
+      my $pid = fork;
+      die "Cannot fork for journal $_" unless defined $pid;
+      unless($pid) {
+        open STDOUT, '>', '/dev/null';
+        exec $cmd or exit 1;
+      }
+      select(undef, undef, undef, 0.05 * $_);
+      kill 'KILL', $pid;
+      waitpid $pid, 0;
+    }
+    system $cmd;
+  }
+
+  die "Failed for journal $_\n" unless dig($file1) eq dig($file2);
+  die "Failed for journal $_: a journal was left behind\n" if -e "msg.enc.journal" || -e "msg.dec.journal";
+  print "ok journal $_\n";
+}
+
+# If the C++ example of otpasync.hpp has been built, run it too - it checks its own results.
+# Its "msg.in" is a few KB, so that each message stays interactive under LOAD and the cache
+# (whose pads are mlock()'d) holds every pad of the plain CACHE run within a modest limit.
+
+open $wr, '>', "msg.in" or die "Cannot open 'msg.in' for writing";
+binmode($wr);
+print $wr chr(1 + int(rand(255)));
+print $wr chr(int(rand(256))) for 1..2000 + int(rand(2000));
+close $wr or die "Cannot close 'msg.in' after writing";
+
+for my $oa (grep { -e $_ } "otpasync.exe", "otpasync") {
+  my $n = 0;
+  for my $opt ('LOAD', 'CACHE', 'COMPRESS HYBRID CACHE') {
+    $n++;
+    my $out = $^O =~ /MSWin32/i ? `.\\$oa $opt 20` : `./$oa $opt 20`;
+    die "Failed for otpasync $n:\n$out" unless $? == 0 && $out =~ /^ok$/m;
+    print "ok otpasync $n\n";
+  }
+  last;
+}
+
+# If otptune.exe has been built, let it write an "otp.tune" (quickly), and check that
+# encrypt.exe and decrypt.exe still round trip with the settings it chose.
+
+for my $tune (grep { -e $_ } "otptune.exe", "otptune") {
+  my $out = $^O =~ /MSWin32/i ? `.\\$tune QUICK` : `./$tune QUICK`;
+  die "Failed for otptune:\n$out" unless $? == 0 && -e "otp.tune";
+
+  for(1..2) {
+    system $_ & 1 ? $enc : "$enc COMPRESS HYBRID";
+    system $dec;
+    die "Failed for otptune $_\n" unless dig($file1) eq dig($file2);
+    print "ok otptune $_\n";
+  }
+
+  unlink "otp.tune";
+  last;
+}
+
+# If genprime.exe has been built, rotate the keys of 2 users into "keyring", and check that
+# encrypt.exe and decrypt.exe (run in a user's directory) accept a rotated key.
+
+for my $gen (grep { -e $_ } "genprime.exe", "genprime") {
+  File::Path::remove_tree("keyring");
+  my $out = $^O =~ /MSWin32/i ? `.\\$gen ROTATE 2` : `./$gen ROTATE 2`;
+  die "Failed for genprime ROTATE:\n$out" unless $? == 0;
+
+  for(0..1) {
+    my $dir = sprintf "keyring/%03d", $_;
+    die "Failed for rotate $_: no key in $dir\n" unless -e "$dir/primes.in" && -e "$dir/next_seed.txt";
+
+    open my $rd, '<', $file1 or die "Cannot open $file1";
+    open my $cp, '>', "$dir/$file1" or die "Cannot open $dir/$file1";
+    binmode $rd;
+    binmode $cp;
+    print $cp do { local $/; <$rd> };
+    close $cp or die "Cannot close $dir/$file1";
+    close $rd;
+
+    chdir $dir or die "Cannot chdir to $dir";
+    system File::Spec->rel2abs($enc, "../..");
+    system File::Spec->rel2abs($dec, "../..");
+    my $ok = dig($file1) eq dig($file2);
+    chdir "../.." or die "Cannot chdir back from $dir";
+
+    die "Failed for rotate $_\n" unless $ok;
+    print "ok rotate $_\n";
+  }
+
+  # Rotated keys are all the same size, so a profile that otptune.exe made for one of them
+  # must still be refused by another.
+  for my $tune (grep { -e $_ } "otptune.exe", "otptune") {
+    chdir "keyring/000" or die "Cannot chdir to keyring/000";
+    $out = `${\File::Spec->rel2abs($tune, "../..")} QUICK`;
+    chdir "../.." or die "Cannot chdir back from keyring/000";
+    die "Failed for rotate tune:\n$out" unless $? == 0 && -e "keyring/000/otp.tune";
+
+    open my $rd, '<', "keyring/000/otp.tune" or die "Cannot open keyring/000/otp.tune";
+    open my $cp, '>', "keyring/001/otp.tune" or die "Cannot open keyring/001/otp.tune";
+    print $cp do { local $/; <$rd> };
+    close $cp or die "Cannot close keyring/001/otp.tune";
+    close $rd;
+
+    chdir "keyring/001" or die "Cannot chdir to keyring/001";
+    $out = `${\File::Spec->rel2abs($enc, "../..")}`;
+    chdir "../.." or die "Cannot chdir back from keyring/001";
+
+    die "Failed for rotate tune:\n$out" unless $out =~ /made for a different primes\.in/;
+    print "ok rotate tune\n";
+    last;
+  }
+
+  # Running ROTATE again must keep the keys that were made (and only write the seed file
+  # that is missing), and OVERWRITE must replace them.
+  my @keys = map { dig(sprintf "keyring/%03d/primes.in", $_) } 0..1;
+  unlink "keyring/001/next_seed.txt";
+  $out = $^O =~ /MSWin32/i ? `.\\$gen ROTATE 2` : `./$gen ROTATE 2`;
+  die "Failed for rotate again:\n$out"
+    unless $? == 0 && $out =~ /2 kept/ && -e "keyring/001/next_seed.txt"
+        && $keys[0] eq dig("keyring/000/primes.in") && $keys[1] eq dig("keyring/001/primes.in");
+  print "ok rotate again\n";
+
+  $out = $^O =~ /MSWin32/i ? `.\\$gen ROTATE 1 OVERWRITE` : `./$gen ROTATE 1 OVERWRITE`;
+  die "Failed for rotate overwrite:\n$out"
+    unless $? == 0 && $keys[0] ne dig("keyring/000/primes.in") && $keys[1] eq dig("keyring/001/primes.in");
+  print "ok rotate overwrite\n";
+
+  # A key rotated in between two APPEND runs must be refused, although N and e are unchanged.
+  chdir "keyring/001" or die "Cannot chdir to keyring/001";
+  $out = `${\File::Spec->rel2abs($enc, "../..")} APPEND`;
+  die "Failed for rotate append:\n$out" unless $? == 0 && -e "msg.enc.state";
+  open $wr, '>>', $file1 or die "Cannot open $file1 for appending";
+  print $wr "more\n";
+  close $wr or die "Cannot close $file1 after appending";
+  open my $rd, '<', "../000/primes.in" or die "Cannot open keyring/000/primes.in";
+  open my $cp, '>', "primes.in" or die "Cannot open keyring/001/primes.in";
+  print $cp do { local $/; <$rd> };
+  close $cp or die "Cannot close keyring/001/primes.in";
+  close $rd;
+  $out = `${\File::Spec->rel2abs($enc, "../..")} APPEND`;
+  chdir "../.." or die "Cannot chdir back from keyring/001";
+  die "Failed for rotate append:\n$out" unless $out =~ /written for a different primes\.in/;
+  print "ok rotate append\n";
+
+  File::Path::remove_tree("keyring");
+  last;
+}
+
 sub dig {
   # Return the SHA-256 hex digest of the specified file
   open(my $RD1, $_[0]) or warn "Can't open $_[0]: $!";